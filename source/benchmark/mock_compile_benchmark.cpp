@@ -0,0 +1,49 @@
+// A file of mock definitions like the hundreds in a large test tree.  make benchmark
+// compiles it against the pre-split Mock.hpp, the current Mock.hpp and MockDefine.hpp
+// and reports the average time of each.
+#ifdef MOCK_BENCHMARK_FULL_HEADER
+#include "Mock.hpp"
+#else
+#include "MockDefine.hpp"
+#endif
+
+
+#define MOCK_BENCHMARK_FUNCTIONS(N) \
+	int mock_benchmark_read_##N(int channel, uint8_t* data, size_t size) \
+	{ \
+		MockData out(data, size); \
+		MOCK_CALL(channel, size); \
+		MOCK_OUTPUT(out); \
+		MOCK_RETURN(int); \
+	} \
+	void mock_benchmark_write_##N(int channel, const uint8_t* data, size_t size) \
+	{ \
+		MOCK_CALL(channel, MockData(data, size)); \
+	} \
+	bool mock_benchmark_poll_##N(unsigned id, long timeout, double scale, char mode) \
+	{ \
+		MOCK_CALL(id, timeout, scale, mode); \
+		MOCK_RETURN(bool); \
+	} \
+	uint32_t mock_benchmark_lookup_##N(const char* name, int16_t low, uint16_t high) \
+	{ \
+		MOCK_CALL(name, low, high); \
+		MOCK_RETURN(uint32_t); \
+	}
+
+MOCK_BENCHMARK_FUNCTIONS(0)
+MOCK_BENCHMARK_FUNCTIONS(1)
+MOCK_BENCHMARK_FUNCTIONS(2)
+MOCK_BENCHMARK_FUNCTIONS(3)
+MOCK_BENCHMARK_FUNCTIONS(4)
+MOCK_BENCHMARK_FUNCTIONS(5)
+MOCK_BENCHMARK_FUNCTIONS(6)
+MOCK_BENCHMARK_FUNCTIONS(7)
+MOCK_BENCHMARK_FUNCTIONS(8)
+MOCK_BENCHMARK_FUNCTIONS(9)
+MOCK_BENCHMARK_FUNCTIONS(10)
+MOCK_BENCHMARK_FUNCTIONS(11)
+MOCK_BENCHMARK_FUNCTIONS(12)
+MOCK_BENCHMARK_FUNCTIONS(13)
+MOCK_BENCHMARK_FUNCTIONS(14)
+MOCK_BENCHMARK_FUNCTIONS(15)
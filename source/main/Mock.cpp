@@ -1,16 +1,41 @@
 #include "Mock.hpp"
 #include "Test.hpp"
 #include <queue>
+#include <deque>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <chrono>
 #include <stdexcept>
 #include <cstring>
+#include <cctype>
 #include <sstream>
 #include <memory>
 #include <iomanip>
+#include <cmath>
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <atomic>
+#include <new>
+#include <cstdio>
+#include <cstdarg>
+#if MOCK_SHARED_EXPECTATIONS
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
 #include "logger.h"
 
 
 LOGGER_ZONE(MOCK);
 
+// Reports a failure through FAIL at the caller's line and hands the same text to
+// mock_fail, and so to any failure handler.
+#define MOCK_FAIL(...) (FAIL(__VA_ARGS__), mock_fail_format(__VA_ARGS__))
+
+static void mock_fail_format(const char* format, ...);
+
 
 enum MockState
 {
@@ -21,6 +46,9 @@ enum MockState
 	MOCK_STATE_RECORD_DONE_WAITING_RETURN,
 	MOCK_STATE_PLAY_WAITING_OUTPUT,
 	MOCK_STATE_PLAY_WAITING_RETURN,
+	MOCK_STATE_PLAY_UNEXPECTED,
+	MOCK_STATE_PLAY_FAULT,
+	MOCK_STATE_PLAY_FUZZ,
 };
 
 
@@ -35,87 +63,254 @@ static const char* to_string(MockState state)
 	case MOCK_STATE_RECORD_DONE_WAITING_RETURN: return "done_wait_return";
 	case MOCK_STATE_PLAY_WAITING_OUTPUT: return "play_wait_output";
 	case MOCK_STATE_PLAY_WAITING_RETURN: return "play_wait_return";
+	case MOCK_STATE_PLAY_UNEXPECTED: return "play_unexpected";
+	case MOCK_STATE_PLAY_FAULT: return "play_fault";
+	case MOCK_STATE_PLAY_FUZZ: return "play_fuzz";
 	default: return "<invalid>";
 	}
 }
 
 
+// Where an expectation was written.  Sites are interned once per EXPECT location and
+// never freed, so expectations only carry a pointer to them.
+struct MockCallSite
+{
+	const char* call_string;
+	const char* filename;
+	size_t line;
+};
+
+// Callback run after a number of further played calls or once the virtual clock has
+// advanced, counted from when its expectation is played.
+struct MockDeferred
+{
+	uint64_t calls;
+	uint64_t delay_ms;
+	std::function<void()> callback;
+};
+
+// Actions are rare compared to plain expectations, so they live out of line and are
+// only allocated once the first action is added.  They are shared between copies of
+// an expectation made from a MockScript and copied before being modified.
+struct MockCallActions
+{
+	std::shared_ptr<mock_value_wrapper> return_value;
+	std::shared_ptr<mock_value_wrapper> exception;
+	std::function<void()> callback;
+	std::shared_ptr<mock_value_wrapper> output;
+	uint64_t delay_ms = 0;
+	MockLatency latency;
+	std::vector<MockDeferred> deferred;
+	bool has_error_number = false;
+	int error_number = 0;
+};
+
+// Matching only touches the name, parameters and return type; diagnostics and actions
+// are reached through pointers to keep the queued expectations small.
 class MockFunctionCall
 {
 public:
-	MockFunctionCall(const char* function_name, const std::vector<std::shared_ptr<mock_value_wrapper>>& params, const char* call_str, const char* filename, size_t line);
+	MockFunctionCall(const char* function_name, const std::vector<std::shared_ptr<mock_value_wrapper>>& params, const MockCallSite* site);
 	MockFunctionCall(const char* function_name, const std::vector<std::shared_ptr<mock_value_wrapper>>& params);
 
 	const char* get_function_name() const { return m_function_name; }
-	const char* get_call_string() const { return m_call_string; }
-	const char* get_filename() const { return m_filename; }
-	size_t get_line() const { return m_line; }
+	const char* get_call_string() const { return m_site ? m_site->call_string : ""; }
+	const char* get_filename() const { return m_site ? m_site->filename : ""; }
+	size_t get_line() const { return m_site ? m_site->line : 0; }
 
 	bool has_return_type() const { return (m_return_type != nullptr); }
-	bool has_return_value() const { return (bool)m_return_value; }
-	bool has_exception() const { return (bool)m_exception; }
-	bool has_callback() const { return (bool)m_callback; }
-	bool has_output() const { return (bool)m_output; }
+	bool has_return_value() const { return m_actions && m_actions->return_value; }
+	bool has_exception() const { return m_actions && m_actions->exception; }
+	bool has_callback() const { return m_actions && m_actions->callback; }
+	bool has_output() const { return m_actions && m_actions->output; }
+	bool has_delay() const { return m_actions && m_actions->delay_ms != 0; }
+	bool has_latency() const { return m_actions && !m_actions->latency.is_none(); }
+	bool has_deferred() const { return m_actions && !m_actions->deferred.empty(); }
+	bool has_error_number() const { return m_actions && m_actions->has_error_number; }
 
 	void set_return_type(const std::type_info& type) { m_return_type = &type; }
-	void set_return_value(const std::shared_ptr<mock_value_wrapper>& value) { m_return_value = value; }
-	void set_exception(const std::shared_ptr<mock_value_wrapper>& exception) { m_exception = exception; }
-	void set_callback(std::function<void()> callback) { m_callback = callback; }
-	void set_output(const std::shared_ptr<mock_value_wrapper>& output) { m_output = output; }
+	void set_return_value(const std::shared_ptr<mock_value_wrapper>& value) { actions().return_value = value; }
+	void set_exception(const std::shared_ptr<mock_value_wrapper>& exception) { actions().exception = exception; }
+	void set_callback(std::function<void()> callback) { actions().callback = callback; }
+	void set_output(const std::shared_ptr<mock_value_wrapper>& output) { actions().output = output; }
+	void set_delay(uint64_t delay_ms) { actions().delay_ms = delay_ms; }
+	void set_latency(const MockLatency& latency) { actions().latency = latency; }
+	void add_deferred(const MockDeferred& deferred) { actions().deferred.push_back(deferred); }
+	void set_error_number(int error_number) { actions().has_error_number = true; actions().error_number = error_number; }
 
 	const std::type_info& get_return_type() const;
-	std::shared_ptr<mock_value_wrapper> get_return_value() const { return m_return_value; }
-	std::shared_ptr<mock_value_wrapper> get_exception() const { return m_exception; }
-	std::function<void()> get_callback() const { return m_callback; }
-	std::shared_ptr<mock_value_wrapper> get_output() const { return m_output; }
+	std::shared_ptr<mock_value_wrapper> get_return_value() const { return m_actions ? m_actions->return_value : nullptr; }
+	std::shared_ptr<mock_value_wrapper> get_exception() const { return m_actions ? m_actions->exception : nullptr; }
+	std::function<void()> get_callback() const { return m_actions ? m_actions->callback : nullptr; }
+	std::shared_ptr<mock_value_wrapper> get_output() const { return m_actions ? m_actions->output : nullptr; }
+	uint64_t get_delay() const { return m_actions ? m_actions->delay_ms : 0; }
+	const MockLatency& get_latency() const { return m_actions->latency; }
+	const std::vector<MockDeferred>& get_deferred() const { return m_actions->deferred; }
+	int get_error_number() const { return m_actions->error_number; }
 
-	void call_callback() const { m_callback(); }
+	void call_callback() const { m_actions->callback(); }
 
 	std::string to_string() const;
+	std::string to_difference_string(const MockFunctionCall& actual) const;
 
 	bool match(const MockFunctionCall&) const;
 
 private:
-	const char* m_function_name;
-	const char* m_call_string;
-	const char* m_filename;
-	size_t m_line;
+	MockCallActions& actions();
 
-	std::vector<std::shared_ptr<mock_value_wrapper>> m_parameters;
+	const char* m_function_name;
 	const std::type_info* m_return_type;
-	std::shared_ptr<mock_value_wrapper> m_return_value;
-	std::shared_ptr<mock_value_wrapper> m_exception;
-	std::function<void()> m_callback;
-	std::shared_ptr<mock_value_wrapper> m_output;
+	std::vector<std::shared_ptr<mock_value_wrapper>> m_parameters;
+	const MockCallSite* m_site;
+	std::shared_ptr<MockCallActions> m_actions;
+};
+
+
+// Expectations in one sequence are played in order; separate sequences may interleave.
+// Sequence 0 holds everything not given a sequence name.
+struct MockSequence
+{
+	std::string name;
+	std::deque<MockFunctionCall> calls;
+};
+
+
+// A deferred callback waiting for its trigger, a played call count or a clock time.
+// Callbacks with equal triggers run in the order they were scheduled.
+struct MockScheduled
+{
+	uint64_t trigger;
+	uint64_t order;
+	std::function<void()> callback;
+	const char* function;
+
+	bool operator>(const MockScheduled& second) const
+	{
+		return (trigger != second.trigger) ? (trigger > second.trigger) : (order > second.order);
+	}
+};
+
+typedef std::priority_queue<MockScheduled, std::vector<MockScheduled>, std::greater<MockScheduled>> MockSchedule;
+
+
+// An interned payload.  Entries only match payloads of the same type, so MockData
+// and std::vector<uint8_t> share entries but other vectors keep their own.
+struct MockPooledData
+{
+	const std::type_info* type;
+	std::weak_ptr<const void> data;
+	const void* bytes;
+	size_t size;
+};
+
+
+// Fault policy of one function and how far through it the calls have got.
+struct MockFaultState
+{
+	std::string function;
+	MockFaultPolicy policy;
+	uint64_t calls;
+	uint64_t burst_remaining;
+};
+
+
+enum MockTraceKind
+{
+	MOCK_TRACE_CALL,
+	MOCK_TRACE_OUTPUT,
+	MOCK_TRACE_RETURN,
+	MOCK_TRACE_CALLBACK,
+};
+
+// One slot of the trace ring.  Writers claim slots with an atomic counter and store
+// sequence last, so the exporter skips slots that are being rewritten.
+struct MockTraceEvent
+{
+	std::atomic<uint64_t> sequence;
+	uint64_t time_ns;
+	uint64_t duration_ns;
+	const char* function;
+	uint32_t thread;
+	MockTraceKind kind;
 };
 
 
 static MockState g_mock_state = MOCK_STATE_IDLE;
-static const char* g_expect_call_str = nullptr;
-static const char* g_expect_filename = nullptr;
-static size_t g_expect_line = 0;
-static std::queue<MockFunctionCall> g_expected_calls;
+static const MockCallSite* g_expect_site = nullptr;
+static std::map<std::tuple<const char*, const char*, size_t>, MockCallSite> g_call_sites;
+static std::vector<MockSequence> g_sequences(1);
+static std::unordered_multimap<const char*, size_t> g_sequence_heads;
+static size_t g_record_sequence = 0;
+static size_t g_play_sequence = 0;
+static std::unordered_multimap<uint64_t, MockPooledData> g_mock_data_pool;
+static size_t g_mock_data_pool_limit = 64;
+static bool g_mock_retain_hashed_data = false;
+static uint64_t g_mock_clock_ms = 0;
+static std::queue<std::shared_ptr<mock_pending_state>> g_pending_ready;
+static size_t g_pending_outstanding = 0;
+static const uint64_t g_mock_default_seed = 0x2545F4914F6CDD1Dull;
+static uint64_t g_mock_random_state = g_mock_default_seed;
+static MockLatency g_mock_default_latency;
+static bool g_mock_collect_all = false;
+static std::vector<std::string> g_mock_report;
+static uint64_t g_mock_played_calls = 0;
+static uint64_t g_mock_scheduled_order = 0;
+static MockSchedule g_deferred_by_calls;
+static MockSchedule g_deferred_by_time;
+static bool g_mock_in_interrupt = false;
+static mock_failure_handler g_mock_failure_handler = nullptr;
+static MockWrap* g_mock_wraps = nullptr;
+static std::vector<std::string> g_mock_spy_log;
+static std::atomic<uint64_t>* g_mock_shared = nullptr;
+static size_t g_mock_shared_size = 0;
+static std::vector<uint64_t> g_mock_shared_consumed;
+static int g_mock_shared_owner = 0;
+static bool g_mock_failed = false;
+static std::map<std::string, MockFaultState> g_mock_faults;
+static std::unordered_map<const char*, MockFaultState*> g_mock_fault_lookup;
+static std::vector<MockFault> g_mock_fault_log;
+static std::shared_ptr<mock_value_wrapper> g_mock_fault_return;
+static bool g_mock_fault_corrupt = false;
+static bool g_mock_fuzzing = false;
+static const uint8_t* g_mock_fuzz_data = nullptr;
+static size_t g_mock_fuzz_size = 0;
+static std::string g_mock_trace_path;
+static std::unique_ptr<MockTraceEvent[]> g_mock_trace;
+static size_t g_mock_trace_capacity = 0;
+static std::atomic<uint64_t> g_mock_trace_next(0);
+static std::chrono::steady_clock::time_point g_mock_trace_start;
+static const char* g_mock_trace_function = "";
 
 
-MockFunctionCall::MockFunctionCall(const char* function_name, const std::vector<std::shared_ptr<mock_value_wrapper>>& params, const char* call_str, const char* filename, size_t line)
+MockFunctionCall::MockFunctionCall(const char* function_name, const std::vector<std::shared_ptr<mock_value_wrapper>>& params, const MockCallSite* site)
 	: m_function_name(function_name)
-	, m_call_string(call_str)
-	, m_filename(filename)
-	, m_line(line)
-	, m_parameters(params)
 	, m_return_type(nullptr)
+	, m_parameters(params)
+	, m_site(site)
 {
 }
 
 MockFunctionCall::MockFunctionCall(const char* function_name, const std::vector<std::shared_ptr<mock_value_wrapper>>& params)
-	: MockFunctionCall(function_name, params, "", "", 0)
+	: MockFunctionCall(function_name, params, nullptr)
 {
 }
 
+MockCallActions& MockFunctionCall::actions()
+{
+	if (!m_actions)
+		m_actions = std::make_shared<MockCallActions>();
+	else if (m_actions.use_count() > 1)
+		m_actions = std::make_shared<MockCallActions>(*m_actions);
+	return *m_actions;
+}
+
 const std::type_info& MockFunctionCall::get_return_type() const
 {
 	if (m_return_type == nullptr)
-		throw std::runtime_error("MockFunctionCall asking for return type when none");
+	{
+		mock_fail("MockFunctionCall asking for return type when none");
+		return typeid(void);
+	}
 	return *m_return_type;
 }
 
@@ -133,6 +328,23 @@ std::string MockFunctionCall::to_string() const
 	return out.str();
 }
 
+std::string MockFunctionCall::to_difference_string(const MockFunctionCall& actual) const
+{
+	std::ostringstream out;
+	if (m_parameters.size() != actual.m_parameters.size())
+		return out.str();
+	for (size_t i = 0; i < m_parameters.size(); i++)
+	{
+		if (m_parameters[i]->equals(actual.m_parameters[i]))
+			continue;
+		std::ostringstream difference;
+		m_parameters[i]->write_difference(difference, actual.m_parameters[i]);
+		if (difference.tellp() > 0)
+			out << " parameter " << i << ": " << difference.str();
+	}
+	return out.str();
+}
+
 bool MockFunctionCall::match(const MockFunctionCall& second) const
 {
 	if (std::strcmp(m_function_name, second.m_function_name) != 0)
@@ -145,54 +357,220 @@ bool MockFunctionCall::match(const MockFunctionCall& second) const
 	return true;
 }
 
-MockData::MockData(const uint8_t* ptr, size_t size)
-	: m_pointer(nullptr)
-	, m_data(ptr, ptr + size)
+// Hashes four independent 64 bit lanes at a time so the loop pipelines (and vectorizes
+// where the target allows it), then folds the lanes and the tail together.
+static uint64_t mock_hash_mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+static uint64_t mock_hash(const uint8_t* data, size_t size)
+{
+	const uint64_t prime = 0x9E3779B97F4A7C15ull;
+	uint64_t lanes[4] = { size, prime, ~(uint64_t)size, prime * prime };
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		for (size_t j = 0; j < 4; j++)
+		{
+			uint64_t word;
+			std::memcpy(&word, data + i + 8 * j, sizeof(word));
+			lanes[j] = (lanes[j] ^ word) * prime;
+			lanes[j] ^= lanes[j] >> 31;
+		}
+	}
+	uint64_t result = mock_hash_mix(lanes[0]) ^ mock_hash_mix(lanes[1] + 1) ^ mock_hash_mix(lanes[2] + 2) ^ mock_hash_mix(lanes[3] + 3);
+	for (; i < size; i += 8)
+	{
+		uint64_t word = 0;
+		std::memcpy(&word, data + i, std::min<size_t>(8, size - i));
+		result = mock_hash_mix((result ^ word) * prime);
+	}
+	return mock_hash_mix(result);
+}
+
+MockData::MockData(const uint8_t* ptr, size_t size, MockDataMode mode)
+	: MockData((uint8_t*)ptr, size, mode)
 {
+	m_pointer = nullptr;
 }
 
-MockData::MockData(uint8_t* ptr, size_t size)
+MockData::MockData(uint8_t* ptr, size_t size, MockDataMode mode)
 	: m_pointer(ptr)
-	, m_data(ptr, ptr + size)
+	, m_size(size)
+	, m_hash(mock_hash(ptr, size))
 {
+	if (mode == MOCK_DATA_BYTES || g_mock_retain_hashed_data)
+		m_data = std::make_shared<const std::vector<uint8_t>>(ptr, ptr + size);
 }
 
-MockData::MockData(const char* ptr, size_t size)
-	: MockData((const uint8_t*)ptr, size)
+MockData::MockData(const char* ptr, size_t size, MockDataMode mode)
+	: MockData((const uint8_t*)ptr, size, mode)
 {
 }
 
-MockData::MockData(char* ptr, size_t size)
-	: MockData((uint8_t*)ptr, size)
+MockData::MockData(char* ptr, size_t size, MockDataMode mode)
+	: MockData((uint8_t*)ptr, size, mode)
 {
 }
 
 MockData& MockData::operator=(const MockData& second)
 {
-	if (m_data.size() < second.m_data.size())
+	if (m_size < second.m_size)
 	{
-		FAIL("MockData setting %zd byte buffer with %zd bytes of data.", m_data.size(), second.m_data.size());
-		throw std::runtime_error("Mock Data buffer overflow");
+		MOCK_FAIL("MockData setting %zd byte buffer with %zd bytes of data.", m_size, second.m_size);
+		return *this;
 	}
 	if (m_pointer == nullptr)
 	{
-		FAIL("Setting data in constant MockData.");
-		throw std::runtime_error("Setting data in constant MockData");
+		MOCK_FAIL("Setting data in constant MockData.");
+		return *this;
+	}
+	if (!second.m_data)
+	{
+		MOCK_FAIL("Setting data from hash only MockData.");
+		return *this;
 	}
 	m_data = second.m_data;
-	for (size_t i = 0; i < m_data.size(); i++)
-		m_pointer[i] = m_data[i];
+	m_size = second.m_size;
+	m_hash = second.m_hash;
+	std::copy(m_data->begin(), m_data->end(), m_pointer);
 
 	return *this;
 }
 
 bool MockData::operator==(const MockData& second) const
 {
-	return (m_data == second.m_data);
+	if (m_size != second.m_size || m_hash != second.m_hash)
+		return false;
+	if (!m_data || !second.m_data || m_data == second.m_data)
+		return true;
+	return (*m_data == *second.m_data);
+}
+
+const std::vector<uint8_t>& MockData::get() const
+{
+	static const std::vector<uint8_t> empty;
+	if (!m_data)
+		return empty;
+	return *m_data;
+}
+
+extern uint64_t mock_hash_bytes(const void* data, size_t size)
+{
+	return mock_hash((const uint8_t*)data, size);
+}
+
+extern std::shared_ptr<const void> mock_intern_bytes(const std::type_info& type, const std::shared_ptr<const void>& data, const void* bytes, size_t size, uint64_t hash)
+{
+	auto range = g_mock_data_pool.equal_range(hash);
+	for (auto i = range.first; i != range.second;)
+	{
+		const MockPooledData& pooled = i->second;
+		if (pooled.data.expired())
+		{
+			i = g_mock_data_pool.erase(i);
+			continue;
+		}
+		if (*pooled.type == type && pooled.size == size)
+		{
+			auto locked = pooled.data.lock();
+			if (locked && (size == 0 || std::memcmp(pooled.bytes, bytes, size) == 0))
+				return locked;
+		}
+		i++;
+	}
+	// Payloads that are never seen again leave expired entries in other buckets, so
+	// the whole pool is swept each time it doubles in size.
+	if (g_mock_data_pool.size() >= g_mock_data_pool_limit)
+	{
+		for (auto i = g_mock_data_pool.begin(); i != g_mock_data_pool.end();)
+		{
+			if (i->second.data.expired())
+				i = g_mock_data_pool.erase(i);
+			else
+				i++;
+		}
+		g_mock_data_pool_limit = std::max<size_t>(64, 2 * g_mock_data_pool.size());
+	}
+	g_mock_data_pool.emplace(hash, MockPooledData{ &type, data, bytes, size });
+	return data;
+}
+
+void MockData::intern()
+{
+	if (!m_data)
+		return;
+	m_data = std::static_pointer_cast<const std::vector<uint8_t>>(mock_intern_bytes(typeid(std::vector<uint8_t>), m_data, m_data->data(), m_data->size(), m_hash));
+}
+
+bool MockData::corrupt(uint64_t random)
+{
+	if (!m_data)
+		return false;
+	if (m_size == 0)
+		return true;
+	auto data = std::make_shared<std::vector<uint8_t>>(*m_data);
+	mock_flip_bit(data->data(), data->size(), random);
+	m_hash = mock_hash(data->data(), data->size());
+	m_data = data;
+	return true;
+}
+
+extern void mock_intern_value(MockData& data)
+{
+	data.intern();
+}
+
+extern bool mock_corrupt_value(MockData& data, uint64_t random)
+{
+	return data.corrupt(random);
+}
+
+size_t MockData::fuzz(const uint8_t* data, size_t size)
+{
+	size_t used = std::min(m_size, size);
+	auto fuzzed = std::make_shared<std::vector<uint8_t>>(m_size, 0);
+	if (used != 0)
+		std::memcpy(fuzzed->data(), data, used);
+	m_hash = mock_hash(fuzzed->data(), m_size);
+	m_data = fuzzed;
+	return used;
+}
+
+extern size_t mock_fuzz_value(MockData& data, const uint8_t* bytes, size_t size)
+{
+	return data.fuzz(bytes, size);
+}
+
+extern size_t mock_copy_fuzz_bytes(void* value, size_t value_size, const uint8_t* data, size_t size)
+{
+	size_t used = std::min(value_size, size);
+	std::memset(value, 0, value_size);
+	if (used != 0)
+		std::memcpy(value, data, used);
+	return used;
+}
+
+extern void mock_flip_bit(void* data, size_t size, uint64_t random)
+{
+	if (size == 0)
+		return;
+	((uint8_t*)data)[(random >> 3) % size] ^= (uint8_t)(1 << (random & 7));
 }
 
 extern std::ostream& operator<<(std::ostream& out, const MockData& data)
 {
+	if (!data.has_data())
+	{
+		out << "<" << std::dec << data.size() << " bytes hash 0x" << std::setw(16) << std::setfill('0') << std::hex << data.get_hash() << ">";
+		return out;
+	}
 	out << "0x";
 	for (uint8_t x : data.get())
 		out << std::setw(2) << std::setfill('0') << std::hex << (uint32_t)x;
@@ -203,195 +581,1370 @@ extern std::ostream& operator<<(std::ostream& out, const MockData& data)
 	return out;
 }
 
-static void mock_set_state(MockState new_state)
+// The comparison loops are kept branch free so the compiler can vectorize them; the
+// slower search for the worst element only runs once a mismatch is known.
+template <typename T>
+static size_t mock_array_count_mismatches(const T* expected, const T* actual, size_t size, double abs_tolerance, double rel_tolerance)
 {
-	g_mock_state = new_state;
+	size_t mismatches = 0;
+	for (size_t i = 0; i < size; i++)
+	{
+		double e = expected[i];
+		double a = actual[i];
+		double limit = abs_tolerance + rel_tolerance * std::fabs(e);
+		bool ok = (e == a) | (std::fabs(e - a) <= limit);
+		mismatches += !ok;
+	}
+	return mismatches;
 }
 
-extern void mock_reset()
+template <typename T>
+static size_t mock_array_count_mismatches(const T* expected, const T* actual, const uint8_t* mask, size_t size, double abs_tolerance, double rel_tolerance)
 {
-	LOG_TRACE("reset");
-	mock_set_state(MOCK_STATE_IDLE);
-	while (!g_expected_calls.empty())
-		g_expected_calls.pop();
+	size_t mismatches = 0;
+	for (size_t i = 0; i < size; i++)
+	{
+		double e = expected[i];
+		double a = actual[i];
+		double limit = abs_tolerance + rel_tolerance * std::fabs(e);
+		bool ok = (e == a) | (std::fabs(e - a) <= limit);
+		mismatches += !ok & (mask[i] != 0);
+	}
+	return mismatches;
 }
 
-extern void mock_verify()
+template <typename T>
+MockArray<T>::MockArray(const T* ptr, size_t size, double abs_tolerance, double rel_tolerance)
+	: m_data(ptr, ptr + size)
+	, m_abs_tolerance(abs_tolerance)
+	, m_rel_tolerance(rel_tolerance)
 {
-	if (g_mock_state == MOCK_STATE_RECORD_DONE)
-		mock_set_state(MOCK_STATE_IDLE);
-	if (g_mock_state != MOCK_STATE_IDLE)
-	{
-		FAIL("Mock internal error: state error (mock_verify %s).", to_string(g_mock_state));
-		throw std::runtime_error("Mock internal error: state error.");
-	}
-	if (!g_expected_calls.empty())
-	{
-		auto& expected = g_expected_calls.front();
-		FAIL("Mock missing %zd expected calls.  Next: '%s' %s:%zd", g_expected_calls.size(), expected.get_call_string(), expected.get_filename(), expected.get_line());
-		throw std::runtime_error("Mock missing expected call.");
-	}
 }
 
-extern void mock_begin_expect(const char* call_str, const char* file_name, size_t line)
+template <typename T>
+MockArray<T>& MockArray<T>::set_mask(const uint8_t* mask)
 {
-	if (g_mock_state == MOCK_STATE_RECORD_DONE)
-		mock_set_state(MOCK_STATE_IDLE);
-	if (g_mock_state == MOCK_STATE_RECORD_DONE_WAITING_RETURN)
-	{
-		FAIL("Mock expected call '%s' missing _AND_RETURN or _AND_THROW %s:%zd", g_expect_call_str, g_expect_filename, g_expect_line);
-		throw std::runtime_error("Mock expected call missing _AND_RETURN or _AND_THROW.");
-	}
-	if (g_mock_state != MOCK_STATE_IDLE)
-	{
-		FAIL("Mock internal error: state error (mock_begin_expect %s).", to_string(g_mock_state));
-		throw std::runtime_error("Mock internal error: state error.");
-	}
-	mock_set_state(MOCK_STATE_RECORD_BEGIN);
-	g_expect_call_str = call_str;
-	g_expect_filename = file_name;
-	g_expect_line = line;
+	m_mask.assign(mask, mask + m_data.size());
+	return *this;
 }
 
-extern void mock_end_expect(const char* call_str)
+template <typename T>
+bool MockArray<T>::operator==(const MockArray& second) const
 {
-	if (g_mock_state == MOCK_STATE_RECORD_BEGIN)
-	{
-		FAIL("Mock of a non-mocked method '%s'.", call_str);
-		throw std::runtime_error("Mock of a non-mocked method.");
-	}
-	if (g_mock_state != MOCK_STATE_RECORD_CALLED)
-	{
-		FAIL("Mock internal error: state error (mock_end_expect %s).", to_string(g_mock_state));
-		throw std::runtime_error("Mock internal error: state error.");
-	}
-	if (std::strcmp(call_str, g_expect_call_str) != 0)
-	{
-		FAIL("Mock internal error: mismatched expect.");
-		throw std::runtime_error("Mock internal error: mismatched expect.");
-	}
-	if (g_expected_calls.empty())
-	{
-		FAIL("Mock internal error: empty call queue.");
-		throw std::runtime_error("Mock internal error: empty call queue.");
-	}
-	auto& expected = g_expected_calls.back();
-	LOG_TRACE("mock record %s", expected.to_string().c_str());
-	if (expected.has_return_type())
-		mock_set_state(MOCK_STATE_RECORD_DONE_WAITING_RETURN);
-	else
-		mock_set_state(MOCK_STATE_RECORD_DONE);
+	if (m_data.size() != second.m_data.size())
+		return false;
+	if (m_mask.empty())
+		return mock_array_count_mismatches(m_data.data(), second.m_data.data(), m_data.size(), m_abs_tolerance, m_rel_tolerance) == 0;
+	return mock_array_count_mismatches(m_data.data(), second.m_data.data(), m_mask.data(), m_data.size(), m_abs_tolerance, m_rel_tolerance) == 0;
 }
 
-extern void mock_add_callback(std::function<void()> callback)
+template <typename T>
+bool MockArray<T>::find_worst(const MockArray& actual, size_t& index, double& deviation, size_t& mismatches) const
 {
-	if (g_mock_state != MOCK_STATE_RECORD_DONE_WAITING_RETURN && g_mock_state != MOCK_STATE_RECORD_DONE)
-	{
-		FAIL("Mock internal error: state error (mock_add_callback %s).", to_string(g_mock_state));
-		throw std::runtime_error("Mock internal error: state error.");
-	}
-	if (g_expected_calls.empty())
-	{
-		FAIL("Mock internal error: empty call queue.");
-		throw std::runtime_error("Mock internal error: empty call queue.");
-	}
-	auto& expected = g_expected_calls.back();
-	if (expected.has_callback())
+	index = 0;
+	deviation = 0;
+	mismatches = 0;
+	if (m_data.size() != actual.m_data.size())
+		return false;
+	for (size_t i = 0; i < m_data.size(); i++)
 	{
-		FAIL("Mock only supports one do action per method.");
-		throw std::runtime_error("Mock only supports one do action per method.");
+		if (!m_mask.empty() && m_mask[i] == 0)
+			continue;
+		double e = m_data[i];
+		double a = actual.m_data[i];
+		if (e == a)
+			continue;
+		double difference = std::fabs(e - a);
+		if (std::isnan(difference))
+			difference = INFINITY;
+		if (!(difference > m_abs_tolerance + m_rel_tolerance * std::fabs(e)))
+			continue;
+		mismatches++;
+		if (difference > deviation)
+		{
+			index = i;
+			deviation = difference;
+		}
 	}
-	expected.set_callback(callback);
+	return true;
 }
 
-extern void mock_add_return(const std::shared_ptr<mock_value_wrapper>& value, const char* value_str)
+template <typename T>
+extern std::ostream& operator<<(std::ostream& out, const MockArray<T>& data)
 {
-	if (g_mock_state == MOCK_STATE_RECORD_DONE)
+	const size_t max_elements = 32;
+	const std::vector<T>& values = data.get();
+	out << "[";
+	for (size_t i = 0; i < values.size() && i < max_elements; i++)
 	{
-		FAIL("Mock '%s' does not expect a return. %s:%zd", g_expect_call_str, g_expect_filename, g_expect_line);
-		throw std::runtime_error("Mock has no return.");
+		if (i != 0)
+			out << ", ";
+		out << +values[i];
 	}
-	if (g_mock_state != MOCK_STATE_RECORD_DONE_WAITING_RETURN)
+	if (values.size() > max_elements)
+		out << ", ... " << values.size() << " elements";
+	out << "]";
+	return out;
+}
+
+template <typename T>
+extern void mock_write_difference(std::ostream& out, const MockArray<T>& expected, const MockArray<T>& actual)
+{
+	size_t index;
+	double deviation;
+	size_t mismatches;
+	if (!expected.find_worst(actual, index, deviation, mismatches))
 	{
-		FAIL("Mock internal error: state error (mock_add_return %s).", to_string(g_mock_state));
-		throw std::runtime_error("Mock internal error: state error.");
+		out << "expected " << expected.get().size() << " elements, got " << actual.get().size();
+		return;
 	}
-	if (g_expected_calls.empty())
+	out << mismatches << " elements out of tolerance, worst deviation " << deviation << " at index " << index;
+	out << " (expected " << +expected.get()[index] << ", actual " << +actual.get()[index] << ")";
+}
+
+#define MOCK_ARRAY_INSTANTIATE(T) \
+	template class MockArray<T>; \
+	template std::ostream& operator<<(std::ostream& out, const MockArray<T>& data); \
+	template void mock_write_difference(std::ostream& out, const MockArray<T>& expected, const MockArray<T>& actual)
+
+MOCK_ARRAY_INSTANTIATE(float);
+MOCK_ARRAY_INSTANTIATE(double);
+MOCK_ARRAY_INSTANTIATE(int8_t);
+MOCK_ARRAY_INSTANTIATE(uint8_t);
+MOCK_ARRAY_INSTANTIATE(int16_t);
+MOCK_ARRAY_INSTANTIATE(uint16_t);
+MOCK_ARRAY_INSTANTIATE(int32_t);
+MOCK_ARRAY_INSTANTIATE(uint32_t);
+
+#define MOCK_VALUE_TYPE_INSTANTIATE(TYPE) \
+	template class mock_value_simple_type<TYPE>; \
+	template class mock_value_type<TYPE>; \
+	template std::shared_ptr<mock_value_wrapper> mock_allocate_wrapper(const TYPE& value); \
+	template void mock_output_typed(TYPE& t)
+
+MOCK_VALUE_TYPE_INSTANTIATE(bool);
+MOCK_VALUE_TYPE_INSTANTIATE(char);
+MOCK_VALUE_TYPE_INSTANTIATE(signed char);
+MOCK_VALUE_TYPE_INSTANTIATE(unsigned char);
+MOCK_VALUE_TYPE_INSTANTIATE(short);
+MOCK_VALUE_TYPE_INSTANTIATE(unsigned short);
+MOCK_VALUE_TYPE_INSTANTIATE(int);
+MOCK_VALUE_TYPE_INSTANTIATE(unsigned int);
+MOCK_VALUE_TYPE_INSTANTIATE(long);
+MOCK_VALUE_TYPE_INSTANTIATE(unsigned long);
+MOCK_VALUE_TYPE_INSTANTIATE(long long);
+MOCK_VALUE_TYPE_INSTANTIATE(unsigned long long);
+MOCK_VALUE_TYPE_INSTANTIATE(float);
+MOCK_VALUE_TYPE_INSTANTIATE(double);
+MOCK_VALUE_TYPE_INSTANTIATE(std::string);
+template class mock_value_type<const char*>;
+template std::shared_ptr<mock_value_wrapper> mock_allocate_wrapper(const char* const& value);
+template std::shared_ptr<mock_value_wrapper> mock_allocate_wrapper(const MockData& value);
+template void mock_output_typed(MockData& t);
+
+// xorshift64*, reseeded by mock_reset so every test sees the same sequence.
+static uint64_t mock_random()
+{
+	g_mock_random_state ^= g_mock_random_state >> 12;
+	g_mock_random_state ^= g_mock_random_state << 25;
+	g_mock_random_state ^= g_mock_random_state >> 27;
+	return g_mock_random_state * 0x2545F4914F6CDD1Dull;
+}
+
+extern void mock_set_random_seed(uint64_t seed)
+{
+	g_mock_random_state = (seed != 0) ? seed : g_mock_default_seed;
+}
+
+MockLatency::MockLatency()
+	: m_uniform(false)
+{
+}
+
+MockLatency MockLatency::fixed(uint64_t ns)
+{
+	MockLatency result;
+	result.m_values.push_back(ns);
+	result.m_weights.push_back(1);
+	return result;
+}
+
+MockLatency MockLatency::uniform(uint64_t min_ns, uint64_t max_ns)
+{
+	MockLatency result;
+	result.m_uniform = true;
+	result.m_values.push_back(std::min(min_ns, max_ns));
+	result.m_values.push_back(std::max(min_ns, max_ns));
+	return result;
+}
+
+MockLatency MockLatency::histogram(const std::vector<std::pair<uint64_t, uint64_t>>& buckets)
+{
+	MockLatency result;
+	uint64_t total = 0;
+	for (auto& bucket : buckets)
 	{
-		FAIL("Mock internal error: empty call queue.");
-		throw std::runtime_error("Mock internal error: empty call queue.");
+		if (bucket.second == 0)
+			continue;
+		total += bucket.second;
+		result.m_values.push_back(bucket.first);
+		result.m_weights.push_back(total);
 	}
-	auto& expected = g_expected_calls.back();
-	if (expected.get_return_type() != value->get_type())
+	return result;
+}
+
+uint64_t MockLatency::sample(uint64_t random) const
+{
+	if (m_values.empty())
+		return 0;
+	if (m_uniform)
 	{
-		const char* expected_type_name = expected.get_return_type().name();
-		const char* actual_type_name = value->get_type().name();
-		FAIL("Mock '%s' expects return type %s, but got %s with %s. %s:%zd", g_expect_call_str, expected_type_name, actual_type_name, value_str, g_expect_filename, g_expect_line);
-		throw std::runtime_error("Mock return type mismatch");
+		// The interval holds span + 1 values, which does not fit when it covers every value.
+		uint64_t span = m_values[1] - m_values[0];
+		if (span == UINT64_MAX)
+			return random;
+		return m_values[0] + random % (span + 1);
 	}
-	expected.set_return_value(value);
-	mock_set_state(MOCK_STATE_IDLE);
+	uint64_t position = random % m_weights.back();
+	size_t bucket = std::upper_bound(m_weights.begin(), m_weights.end(), position) - m_weights.begin();
+	return m_values[bucket];
 }
 
-extern void mock_add_exception(const std::shared_ptr<mock_value_wrapper>& exception)
+// Cost of reading the clock, measured once and subtracted from every wait.
+static uint64_t mock_clock_overhead_ns()
 {
-	if (g_mock_state != MOCK_STATE_RECORD_DONE_WAITING_RETURN && g_mock_state != MOCK_STATE_RECORD_DONE)
+	static const uint64_t overhead = [] {
+		uint64_t best = UINT64_MAX;
+		for (size_t i = 0; i < 64; i++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			auto end = std::chrono::steady_clock::now();
+			best = std::min<uint64_t>(best, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+		}
+		return best;
+	}();
+	return overhead;
+}
+
+extern void mock_busy_wait_ns(uint64_t ns)
+{
+	auto start = std::chrono::steady_clock::now();
+	uint64_t overhead = mock_clock_overhead_ns();
+	if (ns <= overhead)
+		return;
+	auto deadline = start + std::chrono::nanoseconds(ns - overhead);
+	while (std::chrono::steady_clock::now() < deadline)
 	{
-		FAIL("Mock internal error: state error (mock_add_exception %s).", to_string(g_mock_state));
-		throw std::runtime_error("Mock internal error: state error.");
 	}
-	if (g_expected_calls.empty())
+}
+
+static void mock_apply_latency(const MockFunctionCall& call)
+{
+	const MockLatency& latency = call.has_latency() ? call.get_latency() : g_mock_default_latency;
+	if (latency.is_none())
+		return;
+	mock_busy_wait_ns(latency.sample(mock_random()));
+}
+
+static std::deque<MockFunctionCall>& mock_record_calls()
+{
+	return g_sequences[g_record_sequence].calls;
+}
+
+static std::deque<MockFunctionCall>& mock_play_calls()
+{
+	return g_sequences[g_play_sequence].calls;
+}
+
+static size_t mock_find_or_add_sequence(const char* name)
+{
+	if (name == nullptr)
+		return 0;
+	for (size_t i = 1; i < g_sequences.size(); i++)
+		if (g_sequences[i].name == name)
+			return i;
+	g_sequences.push_back(MockSequence{ name, {} });
+	return g_sequences.size() - 1;
+}
+
+// The head of every non-empty sequence is indexed by its function name string, which
+// is the same __PRETTY_FUNCTION__ pointer when recording and playing, so finding the
+// sequences a call can continue does not scan them all.
+static void mock_index_head(size_t sequence)
+{
+	auto& calls = g_sequences[sequence].calls;
+	if (!calls.empty())
+		g_sequence_heads.emplace(calls.front().get_function_name(), sequence);
+}
+
+static void mock_unindex_head(size_t sequence)
+{
+	auto& calls = g_sequences[sequence].calls;
+	if (calls.empty())
+		return;
+	auto range = g_sequence_heads.equal_range(calls.front().get_function_name());
+	for (auto i = range.first; i != range.second; i++)
 	{
-		FAIL("Mock internal error: empty call queue.");
-		throw std::runtime_error("Mock internal error: empty call queue.");
+		if (i->second == sequence)
+		{
+			g_sequence_heads.erase(i);
+			return;
+		}
 	}
-	auto& expected = g_expected_calls.back();
-	expected.set_exception(exception);
-	mock_set_state(MOCK_STATE_IDLE);
 }
 
-extern void mock_call(const std::vector<std::shared_ptr<mock_value_wrapper>>& params, const char* function_name_str)
+static void mock_push_call(size_t sequence, const MockFunctionCall& call)
 {
-	if (g_mock_state == MOCK_STATE_RECORD_DONE)
-		mock_set_state(MOCK_STATE_IDLE);
-	if (g_mock_state == MOCK_STATE_RECORD_BEGIN)
+	auto& calls = g_sequences[sequence].calls;
+	calls.push_back(call);
+	if (calls.size() == 1)
+		mock_index_head(sequence);
+}
+
+static void mock_pop_call(size_t sequence)
+{
+	mock_unindex_head(sequence);
+	g_sequences[sequence].calls.pop_front();
+	mock_index_head(sequence);
+	if (g_mock_shared != nullptr)
+		g_mock_shared_consumed[sequence]++;
+}
+
+// Shared expectations: every process forked after mock_share_expectations holds its own
+// copy of the expected calls, while the number of calls consumed from each sequence
+// lives in shared memory.  g_mock_shared[0] counts mock failures in other processes and
+// g_mock_shared[1 + n] counts calls consumed from sequence n.  Only failures that reach
+// mock_fail are counted; an ASSERT or FAIL of the test itself stays in its process.  Before matching, each
+// process drops the calls other processes have consumed, and it claims a call by
+// advancing the shared count from the value it has seen.
+static void mock_shared_sync()
+{
+	if (g_mock_shared == nullptr)
+		return;
+	for (size_t sequence = 0; sequence < g_sequences.size(); sequence++)
+	{
+		uint64_t consumed = g_mock_shared[1 + sequence].load();
+		while (g_mock_shared_consumed[sequence] < consumed && !g_sequences[sequence].calls.empty())
+			mock_pop_call(sequence);
+	}
+}
+
+static bool mock_shared_claim(size_t sequence)
+{
+	if (g_mock_shared == nullptr)
+		return true;
+	uint64_t consumed = g_mock_shared_consumed[sequence];
+	return g_mock_shared[1 + sequence].compare_exchange_strong(consumed, consumed + 1);
+}
+
+static int mock_process_id()
+{
+#if MOCK_SHARED_EXPECTATIONS
+	return (int)getpid();
+#else
+	return 0;
+#endif
+}
+
+static void mock_unshare_expectations()
+{
+	if (g_mock_shared == nullptr)
+		return;
+#if MOCK_SHARED_EXPECTATIONS
+	munmap(g_mock_shared, g_mock_shared_size);
+#endif
+	g_mock_shared = nullptr;
+	g_mock_shared_size = 0;
+	g_mock_shared_consumed.clear();
+}
+
+static size_t mock_expected_count()
+{
+	size_t count = 0;
+	for (auto& sequence : g_sequences)
+		count += sequence.calls.size();
+	return count;
+}
+
+static const MockFunctionCall* mock_next_expected()
+{
+	for (auto& sequence : g_sequences)
+		if (!sequence.calls.empty())
+			return &sequence.calls.front();
+	return nullptr;
+}
+
+// Picks the lowest numbered sequence whose head matches the call.
+static bool mock_find_sequence(const MockFunctionCall& call, size_t& sequence)
+{
+	bool found = false;
+	auto range = g_sequence_heads.equal_range(call.get_function_name());
+	for (auto i = range.first; i != range.second; i++)
+	{
+		if ((!found || i->second < sequence) && g_sequences[i->second].calls.front().match(call))
+		{
+			sequence = i->second;
+			found = true;
+		}
+	}
+	if (found || range.first != range.second)
+		return found;
+	for (size_t i = 0; i < g_sequences.size(); i++)
+	{
+		if (!g_sequences[i].calls.empty() && g_sequences[i].calls.front().match(call))
+		{
+			sequence = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void mock_report_missing(const MockFunctionCall& expected)
+{
+	std::ostringstream entry;
+	entry << "Missing call " << expected.to_string() << " defined " << expected.get_filename() << ":" << expected.get_line();
+	g_mock_report.push_back(entry.str());
+}
+
+// Finds the expectation an unmatched call most likely corresponds to.  A match a few
+// calls ahead in a sequence means the calls before it are missing; otherwise a call to
+// the function at the head of a sequence is a parameter mismatch and is played as if
+// it matched.  Anything else is an unexpected call.  Returns true when the head of
+// g_play_sequence should be played.
+static bool mock_report_resync(const MockFunctionCall& call)
+{
+	const size_t window = 64;
+	std::ostringstream entry;
+	const MockFunctionCall* next = mock_next_expected();
+	if (next == nullptr)
+	{
+		entry << "Unexpected call " << call.to_string() << " after all expected calls";
+		g_mock_report.push_back(entry.str());
+		return false;
+	}
+	for (size_t sequence = 0; sequence < g_sequences.size(); sequence++)
+	{
+		auto& calls = g_sequences[sequence].calls;
+		for (size_t k = 1; k < calls.size() && k < window; k++)
+		{
+			if (!calls[k].match(call))
+				continue;
+			for (size_t i = 0; i < k; i++)
+			{
+				mock_report_missing(calls.front());
+				mock_pop_call(sequence);
+			}
+			g_play_sequence = sequence;
+			return true;
+		}
+	}
+	for (size_t sequence = 0; sequence < g_sequences.size(); sequence++)
+	{
+		auto& calls = g_sequences[sequence].calls;
+		if (calls.empty() || std::strcmp(calls.front().get_function_name(), call.get_function_name()) != 0)
+			continue;
+		auto& expected = calls.front();
+		entry << "Mismatched call " << call.to_string() << ", expected " << expected.to_string() << " defined " << expected.get_filename() << ":" << expected.get_line();
+		entry << expected.to_difference_string(call);
+		g_mock_report.push_back(entry.str());
+		g_play_sequence = sequence;
+		return true;
+	}
+	entry << "Unexpected call " << call.to_string() << ", next expected " << next->to_string() << " defined " << next->get_filename() << ":" << next->get_line();
+	g_mock_report.push_back(entry.str());
+	return false;
+}
+
+static void mock_report_verify()
+{
+	for (auto& sequence : g_sequences)
+	{
+		for (auto& expected : sequence.calls)
+			mock_report_missing(expected);
+		sequence.calls.clear();
+	}
+	g_sequence_heads.clear();
+	if (g_mock_report.empty())
+		return;
+	for (auto& entry : g_mock_report)
+		LOG_ALWAYS("%s", entry.c_str());
+	size_t problems = g_mock_report.size();
+	g_mock_report.clear();
+	return MOCK_FAIL("Mock found %zd problems.", problems);
+}
+
+extern void mock_set_collect_all(bool collect_all)
+{
+	g_mock_collect_all = collect_all;
+}
+
+extern void mock_set_failure_handler(mock_failure_handler handler)
+{
+	g_mock_failure_handler = handler;
+}
+
+extern bool mock_failed()
+{
+	return g_mock_failed;
+}
+
+static void mock_set_state(MockState new_state)
+{
+	g_mock_state = new_state;
+}
+
+// Every mock failure ends here after FAIL has reported it.  Without a handler it
+// throws, or aborts when exceptions are disabled.  If a handler returns, the failing
+// mock function returns as well and the failure stays visible through mock_failed().
+extern void mock_fail(const char* message)
+{
+	g_mock_failed = true;
+	if (g_mock_shared != nullptr && mock_process_id() != g_mock_shared_owner)
+		g_mock_shared[0]++;
+	if (g_mock_failure_handler != nullptr)
+	{
+		g_mock_failure_handler(message);
+		// The failed call still reaches its MOCK_OUTPUT and MOCK_RETURN, which then
+		// leave outputs untouched and return a default constructed value.
+		if (g_mock_state == MOCK_STATE_IDLE || g_mock_state == MOCK_STATE_PLAY_WAITING_OUTPUT || g_mock_state == MOCK_STATE_PLAY_WAITING_RETURN)
+			mock_set_state(MOCK_STATE_PLAY_UNEXPECTED);
+		return;
+	}
+#if MOCK_EXCEPTIONS
+	throw std::runtime_error(message);
+#else
+	LOG_ALWAYS("%s", message);
+	std::abort();
+#endif
+}
+
+static void mock_fail_format(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	va_list size_args;
+	va_copy(size_args, args);
+	int size = std::vsnprintf(nullptr, 0, format, size_args);
+	va_end(size_args);
+	std::vector<char> message((size > 0) ? size + 1 : 1, '\0');
+	if (size > 0)
+		std::vsnprintf(message.data(), message.size(), format, args);
+	va_end(args);
+	mock_fail(message.data());
+}
+
+// States that finish without another call into the mock are left on the next one.
+static void mock_settle_state()
+{
+	if (g_mock_state == MOCK_STATE_RECORD_DONE || g_mock_state == MOCK_STATE_PLAY_UNEXPECTED || g_mock_state == MOCK_STATE_PLAY_FAULT || g_mock_state == MOCK_STATE_PLAY_FUZZ)
+		mock_set_state(MOCK_STATE_IDLE);
+}
+
+// The bare function name cut out of a pretty function string.  Linker wrap shims
+// answer to the name of the function they wrap.
+// The qualified name of a function from its pretty function string, as the compiler
+// spells it before the parameter list: "int ns::Foo::read(int)" gives "ns::Foo::read"
+// and "void Bar<T>::read() [with T = int]" gives "Bar<T>::read".  The __wrap_ prefix of
+// MOCK_WRAP shims is removed.
+static std::string mock_function_name(const char* function_name_str)
+{
+	const char* end = function_name_str;
+	int depth = 0;
+	while (*end != '\0' && (*end != '(' || depth > 0))
+	{
+		if (*end == '<')
+			depth++;
+		else if (*end == '>' && depth > 0)
+			depth--;
+		end++;
+	}
+	const char* begin = end;
+	depth = 0;
+	while (begin > function_name_str)
+	{
+		char c = begin[-1];
+		if (c == '>')
+			depth++;
+		else if (c == '<' && depth > 0)
+			depth--;
+		else if (depth == 0 && !std::isalnum((unsigned char)c) && c != '_' && c != ':')
+			break;
+		begin--;
+	}
+	std::string name(begin, end);
+	if (name.compare(0, 7, "__wrap_") == 0)
+		name.erase(0, 7);
+	return name;
+}
+
+extern void mock_set_trace(const char* path, size_t capacity)
+{
+	if (path == nullptr || capacity == 0)
 	{
-		g_expected_calls.emplace(function_name_str, params, g_expect_call_str, g_expect_filename, g_expect_line);
+		g_mock_trace.reset();
+		g_mock_trace_path.clear();
+		g_mock_trace_capacity = 0;
+		return;
+	}
+	g_mock_trace.reset(new MockTraceEvent[capacity]);
+	for (size_t i = 0; i < capacity; i++)
+		g_mock_trace[i].sequence.store(0);
+	g_mock_trace_path = path;
+	g_mock_trace_capacity = capacity;
+	g_mock_trace_next.store(0);
+	g_mock_trace_start = std::chrono::steady_clock::now();
+}
+
+static uint64_t mock_trace_now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_mock_trace_start).count();
+}
+
+// Threads are numbered in the order they first record an event.
+static uint32_t mock_thread_id()
+{
+	static std::atomic<uint32_t> next_thread(1);
+	static thread_local uint32_t thread = next_thread.fetch_add(1, std::memory_order_relaxed);
+	return thread;
+}
+
+static void mock_trace_event(MockTraceKind kind, const char* function, uint64_t time_ns, uint64_t duration_ns)
+{
+	uint64_t index = g_mock_trace_next.fetch_add(1, std::memory_order_relaxed);
+	MockTraceEvent& event = g_mock_trace[index % g_mock_trace_capacity];
+	event.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	event.time_ns = time_ns;
+	event.duration_ns = duration_ns;
+	event.function = function;
+	event.thread = mock_thread_id();
+	event.kind = kind;
+	event.sequence.store(index + 1, std::memory_order_release);
+}
+
+static void mock_trace_instant(MockTraceKind kind, const char* function)
+{
+	if (g_mock_trace)
+		mock_trace_event(kind, function, mock_trace_now_ns(), 0);
+}
+
+static void mock_run_callback(const char* function, const std::function<void()>& callback)
+{
+	if (!g_mock_trace)
+		return callback();
+	uint64_t start = mock_trace_now_ns();
+	callback();
+	mock_trace_event(MOCK_TRACE_CALLBACK, function, start, mock_trace_now_ns() - start);
+}
+
+// Writes the events still in the ring as Chrome trace-event JSON, which Perfetto and
+// chrome://tracing both load.  Calls, outputs and returns are instant events and
+// callbacks are complete events spanning the time they ran.
+static void mock_write_trace()
+{
+	if (!g_mock_trace)
+		return;
+	FILE* file = std::fopen(g_mock_trace_path.c_str(), "w");
+	if (file == nullptr)
+		return MOCK_FAIL("Mock unable to write trace '%s'.", g_mock_trace_path.c_str());
+	static const char* const categories[] = { "call", "output", "return", "callback" };
+	std::unordered_map<const char*, std::string> names;
+	uint64_t next = g_mock_trace_next.load(std::memory_order_acquire);
+	uint64_t first = (next > g_mock_trace_capacity) ? next - g_mock_trace_capacity : 0;
+	const char* separator = "";
+	std::fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (uint64_t i = first; i < next; i++)
+	{
+		// A writer may reuse the slot while it is copied, so the copy is only kept
+		// if the slot still holds the same event afterwards.
+		const MockTraceEvent& slot = g_mock_trace[i % g_mock_trace_capacity];
+		if (slot.sequence.load(std::memory_order_acquire) != i + 1)
+			continue;
+		uint64_t time_ns = slot.time_ns;
+		uint64_t duration_ns = slot.duration_ns;
+		const char* function = slot.function;
+		uint32_t thread = slot.thread;
+		MockTraceKind kind = slot.kind;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) != i + 1)
+			continue;
+		auto name = names.find(function);
+		if (name == names.end())
+			name = names.emplace(function, mock_function_name(function)).first;
+		std::fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,", separator, name->second.c_str(), categories[kind], mock_process_id(), thread, time_ns / 1000.0);
+		if (kind == MOCK_TRACE_CALLBACK)
+			std::fprintf(file, "\"ph\":\"X\",\"dur\":%.3f}", duration_ns / 1000.0);
+		else
+			std::fprintf(file, "\"ph\":\"i\",\"s\":\"t\"}");
+		separator = ",";
+	}
+	std::fprintf(file, "\n]}\n");
+	std::fclose(file);
+}
+
+static void mock_schedule_deferred(const MockFunctionCall& expected)
+{
+	if (!expected.has_deferred())
+		return;
+	for (auto& deferred : expected.get_deferred())
+	{
+		if (deferred.delay_ms != 0)
+			g_deferred_by_time.push(MockScheduled{ g_mock_clock_ms + deferred.delay_ms, g_mock_scheduled_order++, deferred.callback, expected.get_function_name() });
+		else
+			g_deferred_by_calls.push(MockScheduled{ g_mock_played_calls + deferred.calls, g_mock_scheduled_order++, deferred.callback, expected.get_function_name() });
+	}
+}
+
+// Runs every deferred callback whose trigger has been reached as one batch, in
+// scheduling order, flagged as interrupt context.  Calls made by the callbacks can
+// make more callbacks due; those run in the next batch rather than recursively.
+// If a callback throws, the rest of its batch goes back on the schedule and runs
+// at the next delivery.
+static void mock_deliver_deferred()
+{
+	struct InterruptContext
+	{
+		InterruptContext() { g_mock_in_interrupt = true; }
+		~InterruptContext() { g_mock_in_interrupt = false; }
+	};
+	struct Batch
+	{
+		std::vector<std::pair<MockSchedule*, MockScheduled>> entries;
+		size_t next = 0;
+
+		~Batch()
+		{
+			for (; next < entries.size(); next++)
+				entries[next].first->push(entries[next].second);
+		}
+	};
+	if (g_mock_in_interrupt)
+		return;
+	InterruptContext context;
+	Batch batch;
+	do
+	{
+		batch.entries.clear();
+		batch.next = 0;
+		while (!g_deferred_by_calls.empty() && g_deferred_by_calls.top().trigger <= g_mock_played_calls)
+		{
+			batch.entries.emplace_back(&g_deferred_by_calls, g_deferred_by_calls.top());
+			g_deferred_by_calls.pop();
+		}
+		while (!g_deferred_by_time.empty() && g_deferred_by_time.top().trigger <= g_mock_clock_ms)
+		{
+			batch.entries.emplace_back(&g_deferred_by_time, g_deferred_by_time.top());
+			g_deferred_by_time.pop();
+		}
+		std::sort(batch.entries.begin(), batch.entries.end(), [](const std::pair<MockSchedule*, MockScheduled>& a, const std::pair<MockSchedule*, MockScheduled>& b) { return a.second.order < b.second.order; });
+		while (batch.next < batch.entries.size())
+		{
+			auto& scheduled = batch.entries[batch.next++].second;
+			mock_run_callback(scheduled.function, scheduled.callback);
+		}
+	} while (!batch.entries.empty());
+}
+
+// Finishes playing the expectation at the head of g_play_sequence.
+static void mock_complete_play()
+{
+	auto& expected = mock_play_calls().front();
+	auto callback = expected.get_callback();
+	const char* expected_function = expected.get_function_name();
+	mock_schedule_deferred(expected);
+	mock_pop_call(g_play_sequence);
+	mock_set_state(MOCK_STATE_IDLE);
+	if (callback)
+		mock_run_callback(expected_function, callback);
+	mock_deliver_deferred();
+}
+
+extern void mock_set_retain_hashed_data(bool retain)
+{
+	g_mock_retain_hashed_data = retain;
+}
+
+mock_pending_state::mock_pending_state(const std::type_info& type)
+	: m_type(type)
+{
+}
+
+void mock_pending_state::attach(const std::type_info& type, std::function<void(const std::shared_ptr<mock_value_wrapper>&)> continuation)
+{
+	if (type != m_type)
+		return MOCK_FAIL("Mock pending result of type %s attached as %s.", m_type.name(), type.name());
+	if (m_continuation)
+		return MOCK_FAIL("Mock pending result returned by more than one call.");
+	m_continuation = continuation;
+	if (m_value)
+		g_pending_ready.push(shared_from_this());
+	else
+		g_pending_outstanding++;
+}
+
+void mock_pending_state::complete(const std::shared_ptr<mock_value_wrapper>& value)
+{
+	if (m_value)
+		return MOCK_FAIL("Mock pending result completed twice.");
+	if (value->get_type() != m_type)
+		return MOCK_FAIL("Mock pending result of type %s completed with %s.", m_type.name(), value->get_type().name());
+	m_value = value;
+	if (m_continuation)
+	{
+		g_pending_outstanding--;
+		g_pending_ready.push(shared_from_this());
+	}
+}
+
+void mock_pending_state::deliver()
+{
+	LOG_TRACE("mock deliver pending %s", m_type.name());
+	m_continuation(m_value);
+}
+
+extern size_t mock_run_pending()
+{
+	size_t delivered = 0;
+	while (!g_pending_ready.empty())
+	{
+		auto pending = g_pending_ready.front();
+		g_pending_ready.pop();
+		pending->deliver();
+		delivered++;
+	}
+	return delivered;
+}
+
+extern void mock_reset()
+{
+	LOG_TRACE("reset");
+	mock_set_state(MOCK_STATE_IDLE);
+	g_sequences.clear();
+	g_sequences.resize(1);
+	g_sequence_heads.clear();
+	g_record_sequence = 0;
+	g_play_sequence = 0;
+	g_mock_data_pool.clear();
+	g_mock_data_pool_limit = 64;
+	g_mock_clock_ms = 0;
+	while (!g_pending_ready.empty())
+		g_pending_ready.pop();
+	g_pending_outstanding = 0;
+	g_mock_random_state = g_mock_default_seed;
+	g_mock_default_latency = MockLatency();
+	g_mock_collect_all = false;
+	g_mock_report.clear();
+	g_mock_played_calls = 0;
+	g_deferred_by_calls = MockSchedule();
+	g_deferred_by_time = MockSchedule();
+	g_mock_failed = false;
+	g_mock_failure_handler = nullptr;
+	for (MockWrap* wrap = g_mock_wraps; wrap != nullptr; wrap = wrap->get_next())
+		wrap->set_mode(MOCK_WRAP_REAL);
+	g_mock_spy_log.clear();
+	mock_unshare_expectations();
+	g_mock_faults.clear();
+	g_mock_fault_lookup.clear();
+	g_mock_fault_log.clear();
+	g_mock_fault_return.reset();
+	mock_set_trace(nullptr);
+}
+
+extern void mock_verify()
+{
+	mock_settle_state();
+	mock_write_trace();
+	if (g_mock_state != MOCK_STATE_IDLE)
+		return MOCK_FAIL("Mock internal error: state error (mock_verify %s).", to_string(g_mock_state));
+	mock_shared_sync();
+	if (g_mock_shared != nullptr && g_mock_shared[0].load() != 0)
+		return MOCK_FAIL("Mock had %zd failures in other processes.", (size_t)g_mock_shared[0].load());
+	if (!g_pending_ready.empty())
+		return MOCK_FAIL("Mock has %zd completed pending results that were never delivered.", g_pending_ready.size());
+	if (g_pending_outstanding != 0)
+		return MOCK_FAIL("Mock has %zd pending results that were returned but never completed.", g_pending_outstanding);
+	if (!g_deferred_by_calls.empty() || !g_deferred_by_time.empty())
+		return MOCK_FAIL("Mock has %zd deferred actions that never ran.", g_deferred_by_calls.size() + g_deferred_by_time.size());
+	if (g_mock_collect_all)
+		mock_report_verify();
+	const MockFunctionCall* next = mock_next_expected();
+	if (next != nullptr)
+	{
+		auto& expected = *next;
+		return MOCK_FAIL("Mock missing %zd expected calls.  Next: '%s' %s:%zd", mock_expected_count(), expected.get_call_string(), expected.get_filename(), expected.get_line());
+	}
+}
+
+extern MockScript mock_record_script(std::function<void()> record)
+{
+	mock_settle_state();
+	if (g_mock_state != MOCK_STATE_IDLE)
+	{
+		MOCK_FAIL("Mock internal error: state error (mock_record_script %s).", to_string(g_mock_state));
+		return MockScript();
+	}
+	std::vector<MockSequence> saved_sequences(1);
+	std::unordered_multimap<const char*, size_t> saved_heads;
+	std::swap(saved_sequences, g_sequences);
+	std::swap(saved_heads, g_sequence_heads);
+#if MOCK_EXCEPTIONS
+	try
+	{
+		record();
+	}
+	catch (...)
+	{
+		std::swap(saved_sequences, g_sequences);
+		std::swap(saved_heads, g_sequence_heads);
+		mock_set_state(MOCK_STATE_IDLE);
+		throw;
+	}
+#else
+	record();
+#endif
+	std::swap(saved_sequences, g_sequences);
+	std::swap(saved_heads, g_sequence_heads);
+	mock_settle_state();
+	if (g_mock_state == MOCK_STATE_RECORD_DONE_WAITING_RETURN)
+	{
+		mock_set_state(MOCK_STATE_IDLE);
+		MOCK_FAIL("Mock expected call '%s' missing _AND_RETURN or _AND_THROW %s:%zd", g_expect_site->call_string, g_expect_site->filename, g_expect_site->line);
+		return MockScript();
+	}
+	if (g_mock_state != MOCK_STATE_IDLE)
+	{
+		MOCK_FAIL("Mock internal error: state error (mock_record_script %s).", to_string(g_mock_state));
+		return MockScript();
+	}
+	if (saved_sequences.size() != 1)
+	{
+		MOCK_FAIL("Mock scripts do not support named sequences.");
+		return MockScript();
+	}
+	auto& saved_calls = saved_sequences[0].calls;
+	auto calls = std::make_shared<std::vector<MockFunctionCall>>();
+	calls->reserve(saved_calls.size());
+	while (!saved_calls.empty())
+	{
+		calls->push_back(std::move(saved_calls.front()));
+		saved_calls.pop_front();
+	}
+	LOG_TRACE("mock record script %zd calls", calls->size());
+	return MockScript(calls);
+}
+
+extern void mock_share_expectations()
+{
+	mock_settle_state();
+	if (g_mock_state != MOCK_STATE_IDLE)
+		return MOCK_FAIL("Mock internal error: state error (mock_share_expectations %s).", to_string(g_mock_state));
+	if (g_mock_shared != nullptr)
+		return MOCK_FAIL("Mock expectations are already shared.");
+#if MOCK_SHARED_EXPECTATIONS
+	size_t size = sizeof(std::atomic<uint64_t>) * (1 + g_sequences.size());
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return MOCK_FAIL("Mock unable to map %zd bytes of shared memory.", size);
+	g_mock_shared = (std::atomic<uint64_t>*)memory;
+	g_mock_shared_size = size;
+	for (size_t i = 0; i < 1 + g_sequences.size(); i++)
+		new (&g_mock_shared[i]) std::atomic<uint64_t>(0);
+	g_mock_shared_consumed.assign(g_sequences.size(), 0);
+	g_mock_shared_owner = mock_process_id();
+	LOG_TRACE("mock share %zd calls", mock_expected_count());
+#else
+	MOCK_FAIL("Mock shared expectations need fork and shared memory, which this platform lacks.");
+#endif
+}
+
+extern void mock_expect_script(const MockScript& script)
+{
+	mock_settle_state();
+	if (g_mock_state != MOCK_STATE_IDLE)
+		return MOCK_FAIL("Mock internal error: state error (mock_expect_script %s).", to_string(g_mock_state));
+	if (g_mock_shared != nullptr)
+		return MOCK_FAIL("Mock cannot add expected calls after mock_share_expectations.");
+	for (const MockFunctionCall& call : script.get())
+		mock_push_call(0, call);
+}
+
+MockScript::MockScript()
+	: m_calls(std::make_shared<std::vector<MockFunctionCall>>())
+{
+}
+
+MockScript::MockScript(const std::shared_ptr<const std::vector<MockFunctionCall>>& calls)
+	: m_calls(calls)
+{
+}
+
+size_t MockScript::size() const
+{
+	return m_calls->size();
+}
+
+extern void mock_begin_expect(const char* call_str, const char* file_name, size_t line)
+{
+	mock_begin_expect_in(nullptr, call_str, file_name, line);
+}
+
+extern void mock_begin_expect_in(const char* sequence, const char* call_str, const char* file_name, size_t line)
+{
+	if (g_mock_shared != nullptr)
+		return MOCK_FAIL("Mock cannot add expected call '%s' after mock_share_expectations. %s:%zd", call_str, file_name, line);
+	mock_settle_state();
+	if (g_mock_state == MOCK_STATE_RECORD_DONE_WAITING_RETURN)
+		return MOCK_FAIL("Mock expected call '%s' missing _AND_RETURN or _AND_THROW %s:%zd", g_expect_site->call_string, g_expect_site->filename, g_expect_site->line);
+	if (g_mock_state != MOCK_STATE_IDLE)
+		return MOCK_FAIL("Mock internal error: state error (mock_begin_expect %s).", to_string(g_mock_state));
+	mock_set_state(MOCK_STATE_RECORD_BEGIN);
+	auto key = std::make_tuple(call_str, file_name, line);
+	auto site = g_call_sites.find(key);
+	if (site == g_call_sites.end())
+		site = g_call_sites.emplace(key, MockCallSite{ call_str, file_name, line }).first;
+	g_expect_site = &site->second;
+	g_record_sequence = mock_find_or_add_sequence(sequence);
+}
+
+extern void mock_end_expect(const char* call_str)
+{
+	if (g_mock_state == MOCK_STATE_RECORD_BEGIN)
+		return MOCK_FAIL("Mock of a non-mocked method '%s'.", call_str);
+	if (g_mock_state != MOCK_STATE_RECORD_CALLED)
+		return MOCK_FAIL("Mock internal error: state error (mock_end_expect %s).", to_string(g_mock_state));
+	if (std::strcmp(call_str, g_expect_site->call_string) != 0)
+		return MOCK_FAIL("Mock internal error: mismatched expect.");
+	if (mock_record_calls().empty())
+		return MOCK_FAIL("Mock internal error: empty call queue.");
+	auto& expected = mock_record_calls().back();
+	LOG_TRACE("mock record %s", expected.to_string().c_str());
+	if (expected.has_return_type())
+		mock_set_state(MOCK_STATE_RECORD_DONE_WAITING_RETURN);
+	else
+		mock_set_state(MOCK_STATE_RECORD_DONE);
+}
+
+extern void mock_add_callback(std::function<void()> callback)
+{
+	if (g_mock_state != MOCK_STATE_RECORD_DONE_WAITING_RETURN && g_mock_state != MOCK_STATE_RECORD_DONE)
+		return MOCK_FAIL("Mock internal error: state error (mock_add_callback %s).", to_string(g_mock_state));
+	if (mock_record_calls().empty())
+		return MOCK_FAIL("Mock internal error: empty call queue.");
+	auto& expected = mock_record_calls().back();
+	if (expected.has_callback())
+		return MOCK_FAIL("Mock only supports one do action per method.");
+	expected.set_callback(callback);
+}
+
+extern void mock_add_delay(uint64_t delay_ms)
+{
+	if (g_mock_state != MOCK_STATE_RECORD_DONE_WAITING_RETURN && g_mock_state != MOCK_STATE_RECORD_DONE)
+		return MOCK_FAIL("Mock internal error: state error (mock_add_delay %s).", to_string(g_mock_state));
+	if (mock_record_calls().empty())
+		return MOCK_FAIL("Mock internal error: empty call queue.");
+	auto& expected = mock_record_calls().back();
+	if (expected.has_delay())
+		return MOCK_FAIL("Mock only supports one delay per method.");
+	expected.set_delay(delay_ms);
+}
+
+extern void mock_add_latency(const MockLatency& latency)
+{
+	if (g_mock_state != MOCK_STATE_RECORD_DONE_WAITING_RETURN && g_mock_state != MOCK_STATE_RECORD_DONE)
+		return MOCK_FAIL("Mock internal error: state error (mock_add_latency %s).", to_string(g_mock_state));
+	if (mock_record_calls().empty())
+		return MOCK_FAIL("Mock internal error: empty call queue.");
+	auto& expected = mock_record_calls().back();
+	if (expected.has_latency())
+		return MOCK_FAIL("Mock only supports one latency per method.");
+	expected.set_latency(latency);
+}
+
+extern void mock_set_default_latency(const MockLatency& latency)
+{
+	g_mock_default_latency = latency;
+}
+
+extern uint64_t mock_clock_ms()
+{
+	return g_mock_clock_ms;
+}
+
+extern void mock_advance_clock(uint64_t delay_ms)
+{
+	g_mock_clock_ms += delay_ms;
+	mock_settle_state();
+	if (g_mock_state == MOCK_STATE_IDLE)
+		mock_deliver_deferred();
+}
+
+extern void mock_add_deferred(uint64_t calls, uint64_t delay_ms, std::function<void()> callback)
+{
+	if (g_mock_state != MOCK_STATE_RECORD_DONE_WAITING_RETURN && g_mock_state != MOCK_STATE_RECORD_DONE)
+		return MOCK_FAIL("Mock internal error: state error (mock_add_deferred %s).", to_string(g_mock_state));
+	if (mock_record_calls().empty())
+		return MOCK_FAIL("Mock internal error: empty call queue.");
+	auto& expected = mock_record_calls().back();
+	expected.add_deferred(MockDeferred{ calls, delay_ms, callback });
+}
+
+extern void mock_add_error_number(int error_number)
+{
+	if (g_mock_state != MOCK_STATE_RECORD_DONE_WAITING_RETURN && g_mock_state != MOCK_STATE_RECORD_DONE)
+		return MOCK_FAIL("Mock internal error: state error (mock_add_error_number %s).", to_string(g_mock_state));
+	if (mock_record_calls().empty())
+		return MOCK_FAIL("Mock internal error: empty call queue.");
+	auto& expected = mock_record_calls().back();
+	if (expected.has_error_number())
+		return MOCK_FAIL("Mock only supports one errno per method.");
+	expected.set_error_number(error_number);
+}
+
+extern bool mock_in_interrupt()
+{
+	return g_mock_in_interrupt;
+}
+
+extern void mock_add_return(const std::shared_ptr<mock_value_wrapper>& value, const char* value_str)
+{
+	if (g_mock_state == MOCK_STATE_RECORD_DONE)
+		return MOCK_FAIL("Mock '%s' does not expect a return. %s:%zd", g_expect_site->call_string, g_expect_site->filename, g_expect_site->line);
+	if (g_mock_state != MOCK_STATE_RECORD_DONE_WAITING_RETURN)
+		return MOCK_FAIL("Mock internal error: state error (mock_add_return %s).", to_string(g_mock_state));
+	if (mock_record_calls().empty())
+		return MOCK_FAIL("Mock internal error: empty call queue.");
+	auto& expected = mock_record_calls().back();
+	if (expected.get_return_type() != value->get_type())
+	{
+		const char* expected_type_name = expected.get_return_type().name();
+		const char* actual_type_name = value->get_type().name();
+		return MOCK_FAIL("Mock '%s' expects return type %s, but got %s with %s. %s:%zd", g_expect_site->call_string, expected_type_name, actual_type_name, value_str, g_expect_site->filename, g_expect_site->line);
+	}
+	expected.set_return_value(value);
+	mock_set_state(MOCK_STATE_IDLE);
+}
+
+extern void mock_add_exception(const std::shared_ptr<mock_value_wrapper>& exception)
+{
+	if (g_mock_state != MOCK_STATE_RECORD_DONE_WAITING_RETURN && g_mock_state != MOCK_STATE_RECORD_DONE)
+		return MOCK_FAIL("Mock internal error: state error (mock_add_exception %s).", to_string(g_mock_state));
+	if (mock_record_calls().empty())
+		return MOCK_FAIL("Mock internal error: empty call queue.");
+	auto& expected = mock_record_calls().back();
+	expected.set_exception(exception);
+	mock_set_state(MOCK_STATE_IDLE);
+}
+
+MockFaultPolicy::MockFaultPolicy()
+	: m_rate(0)
+	, m_burst(1)
+	, m_corrupt_output(false)
+{
+}
+
+MockFaultPolicy& MockFaultPolicy::set_rate(double rate)
+{
+	m_rate = rate;
+	return *this;
+}
+
+MockFaultPolicy& MockFaultPolicy::set_burst(uint64_t burst)
+{
+	m_burst = std::max<uint64_t>(burst, 1);
+	return *this;
+}
+
+MockFaultPolicy& MockFaultPolicy::set_schedule(const std::vector<uint64_t>& calls)
+{
+	m_schedule = calls;
+	std::sort(m_schedule.begin(), m_schedule.end());
+	return *this;
+}
+
+MockFaultPolicy& MockFaultPolicy::set_corrupt_output(bool corrupt)
+{
+	m_corrupt_output = corrupt;
+	return *this;
+}
+
+extern void mock_set_fault_policy(const char* function, const MockFaultPolicy& policy)
+{
+	g_mock_faults[function] = MockFaultState{ function, policy, 0, 0 };
+	g_mock_fault_lookup.clear();
+}
+
+extern const std::vector<MockFault>& mock_fault_log()
+{
+	return g_mock_fault_log;
+}
+
+// Policies are named by the qualified function name, so the name is cut out of the
+// pretty function string once and the result cached by its address.
+static MockFaultState* mock_find_fault(const char* function_name_str)
+{
+	auto cached = g_mock_fault_lookup.find(function_name_str);
+	if (cached != g_mock_fault_lookup.end())
+		return cached->second;
+	std::string name = mock_function_name(function_name_str);
+	auto fault = g_mock_faults.find(name);
+	MockFaultState* result = (fault != g_mock_faults.end()) ? &fault->second : nullptr;
+	g_mock_fault_lookup.emplace(function_name_str, result);
+	return result;
+}
+
+static void mock_play_fault(MockFaultState& fault)
+{
+	const MockFaultPolicy& policy = fault.policy;
+	uint64_t call = fault.calls++;
+	bool faulted = false;
+	if (fault.burst_remaining > 0)
+	{
+		fault.burst_remaining--;
+		faulted = true;
+	}
+	else if (std::binary_search(policy.get_schedule().begin(), policy.get_schedule().end(), call) || (policy.get_rate() > 0 && (mock_random() >> 11) * 0x1.0p-53 < policy.get_rate()))
+	{
+		fault.burst_remaining = policy.get_burst() - 1;
+		faulted = true;
+	}
+	if (faulted)
+	{
+		LOG_TRACE("mock fault %s call %zd", fault.function.c_str(), (size_t)call);
+		g_mock_fault_log.push_back(MockFault{ fault.function, call });
+		if (policy.get_fault_exception())
+		{
+			policy.get_fault_exception()->throw_exception();
+			return MOCK_FAIL("Mock throw failed.");
+		}
+	}
+	g_mock_fault_return = (faulted && policy.get_fault_return()) ? policy.get_fault_return() : policy.get_return();
+	g_mock_fault_corrupt = faulted && policy.get_corrupt_output();
+	mock_set_state(MOCK_STATE_PLAY_FAULT);
+}
+
+static void mock_use_fuzz_input(mock_value_wrapper& value)
+{
+	size_t used = value.fuzz(g_mock_fuzz_data, g_mock_fuzz_size);
+	g_mock_fuzz_data += used;
+	g_mock_fuzz_size -= used;
+}
+
+// Ends a fuzz run.  Only the input is dropped, so a run costs the same however many
+// calls it made.
+static void mock_end_fuzz()
+{
+	g_mock_fuzzing = false;
+	g_mock_fuzz_data = nullptr;
+	g_mock_fuzz_size = 0;
+	if (g_mock_state == MOCK_STATE_PLAY_FUZZ)
+		mock_set_state(MOCK_STATE_IDLE);
+}
+
+extern int mock_fuzz_one(const uint8_t* data, size_t size, std::function<void()> target)
+{
+	mock_settle_state();
+	if (g_mock_state != MOCK_STATE_IDLE || g_mock_fuzzing)
+	{
+		MOCK_FAIL("Mock internal error: state error (mock_fuzz_one %s).", to_string(g_mock_state));
+		return 0;
+	}
+	g_mock_fuzzing = true;
+	g_mock_fuzz_data = data;
+	g_mock_fuzz_size = size;
+#if MOCK_EXCEPTIONS
+	try
+	{
+		target();
+	}
+	catch (...)
+	{
+		mock_end_fuzz();
+		throw;
+	}
+#else
+	target();
+#endif
+	mock_end_fuzz();
+	return 0;
+}
+
+extern void mock_call(const std::vector<std::shared_ptr<mock_value_wrapper>>& params, const char* function_name_str)
+{
+	mock_settle_state();
+	if (g_mock_trace && g_mock_state == MOCK_STATE_IDLE)
+	{
+		g_mock_trace_function = function_name_str;
+		mock_trace_instant(MOCK_TRACE_CALL, function_name_str);
+	}
+	if (g_mock_fuzzing && g_mock_state == MOCK_STATE_IDLE)
+	{
+		mock_set_state(MOCK_STATE_PLAY_FUZZ);
+		return;
+	}
+	if (g_mock_state == MOCK_STATE_RECORD_BEGIN)
+	{
+		for (auto& param : params)
+			param->intern();
+		mock_push_call(g_record_sequence, MockFunctionCall(function_name_str, params, g_expect_site));
 		mock_set_state(MOCK_STATE_RECORD_CALLED);
 		return;
 	}
 	MockFunctionCall call(function_name_str, params);
 	if (g_mock_state == MOCK_STATE_RECORD_CALLED)
-	{
-		FAIL("Mock '%s' calls multiple mocked methods. %s:%zd", g_expect_call_str, g_expect_filename, g_expect_line);
-		throw std::runtime_error("Mock calls multiple mocked methods.");
-	}
+		return MOCK_FAIL("Mock '%s' calls multiple mocked methods. %s:%zd", g_expect_site->call_string, g_expect_site->filename, g_expect_site->line);
 	if (g_mock_state != MOCK_STATE_IDLE)
+		return MOCK_FAIL("Mock internal error: state error (mock_call %s).", to_string(g_mock_state));
+	if (!g_mock_faults.empty())
 	{
-		FAIL("Mock internal error: state error (mock_call %s).", to_string(g_mock_state));
-		throw std::runtime_error("Mock internal error: state error.");
+		MockFaultState* fault = mock_find_fault(function_name_str);
+		if (fault != nullptr)
+			return mock_play_fault(*fault);
 	}
-	if (g_expected_calls.empty())
+	bool found;
+	do
 	{
-		FAIL("Mock unexpected call %s.", call.to_string().c_str());
-		throw std::runtime_error("Mock unexpected call.");
+		mock_shared_sync();
+		found = mock_find_sequence(call, g_play_sequence);
+	} while (found && !mock_shared_claim(g_play_sequence));
+	bool collect_all = g_mock_collect_all && g_mock_shared == nullptr;
+	if (!found && collect_all && !mock_report_resync(call))
+	{
+		mock_set_state(MOCK_STATE_PLAY_UNEXPECTED);
+		return;
 	}
-	auto& expected = g_expected_calls.front();
-	if (!expected.match(call))
+	if (!found && !collect_all)
 	{
-		LOG_ALWAYS("Expected %s defined %s:%zd", expected.to_string().c_str(), expected.get_filename(), expected.get_line());
+		if (mock_next_expected() == nullptr)
+			return MOCK_FAIL("Mock unexpected call %s.", call.to_string().c_str());
+		for (auto& sequence : g_sequences)
+		{
+			if (sequence.calls.empty())
+				continue;
+			auto& expected = sequence.calls.front();
+			LOG_ALWAYS("Expected %s defined %s:%zd", expected.to_string().c_str(), expected.get_filename(), expected.get_line());
+			std::string difference = expected.to_difference_string(call);
+			if (!difference.empty())
+				LOG_ALWAYS("Difference%s", difference.c_str());
+		}
 		LOG_ALWAYS("Actual   %s", call.to_string().c_str());
-		FAIL("Mock mismatched call.");
-		throw std::runtime_error("Mock mismatched call.");
+		return MOCK_FAIL("Mock mismatched call.");
 	}
+	auto& expected = mock_play_calls().front();
 	LOG_TRACE("mock play %s", expected.to_string().c_str());
+	g_mock_played_calls++;
+	g_mock_clock_ms += expected.get_delay();
+	mock_apply_latency(expected);
+	if (expected.has_error_number())
+		errno = expected.get_error_number();
 	if (expected.has_exception())
 	{
 		auto exception = expected.get_exception();
-		g_expected_calls.pop();
+		mock_schedule_deferred(expected);
+		mock_pop_call(g_play_sequence);
+		mock_deliver_deferred();
 		exception->throw_exception();
-		FAIL("Mock throw failed.");
-		throw std::runtime_error("Mock throw failed.");
+		return MOCK_FAIL("Mock throw failed.");
 	}
 	if (expected.has_output())
 	{
@@ -403,39 +1956,91 @@ extern void mock_call(const std::vector<std::shared_ptr<mock_value_wrapper>>& pa
 	}
 	else
 	{
-		auto callback = expected.get_callback();
-		g_expected_calls.pop();
-		mock_set_state(MOCK_STATE_IDLE);
-		if (callback)
-			callback();
+		mock_complete_play();
+	}
+}
+
+MockWrap::MockWrap(const char* name)
+	: m_name(name)
+	, m_mode(MOCK_WRAP_REAL)
+	, m_next(g_mock_wraps)
+{
+	g_mock_wraps = this;
+}
+
+extern void mock_set_wrap_mode(const char* name, MockWrapMode mode)
+{
+	for (MockWrap* wrap = g_mock_wraps; wrap != nullptr; wrap = wrap->get_next())
+	{
+		if (std::strcmp(wrap->get_name(), name) == 0)
+		{
+			wrap->set_mode(mode);
+			return;
+		}
 	}
+	return MOCK_FAIL("Mock has no wrapped function '%s'.", name);
+}
+
+// Whether a wrapped call goes to the real function.  An EXPECT on a wrap that is not
+// in MOCK_WRAP_MOCK mode fails rather than running the real function, and is then
+// recorded anyway.
+extern bool mock_wrap_passes_through(const MockWrap& wrap)
+{
+	if (wrap.get_mode() == MOCK_WRAP_MOCK)
+		return false;
+	if (g_mock_state != MOCK_STATE_RECORD_BEGIN)
+		return true;
+	MOCK_FAIL("Mock EXPECT of %s, which is wrapped in %s mode; set MOCK_WRAP_MOCK before the EXPECT.", wrap.get_name(), (wrap.get_mode() == MOCK_WRAP_SPY) ? "MOCK_WRAP_SPY" : "MOCK_WRAP_REAL");
+	return false;
+}
+
+extern void mock_spy(const std::vector<std::shared_ptr<mock_value_wrapper>>& params, const char* function_name_str)
+{
+	MockFunctionCall call(function_name_str, params);
+	LOG_TRACE("mock spy %s", call.to_string().c_str());
+	g_mock_spy_log.push_back(call.to_string());
+}
+
+extern const std::vector<std::string>& mock_spy_log()
+{
+	return g_mock_spy_log;
 }
 
 extern void mock_output(const std::shared_ptr<mock_value_wrapper>& output)
 {
 	if (g_mock_state == MOCK_STATE_RECORD_CALLED)
 	{
-		ASSERT(!g_expected_calls.empty());
-		auto& expected = g_expected_calls.back();
+		if (mock_record_calls().empty())
+			return MOCK_FAIL("Mock internal error: no call recorded (mock_output).");
+		auto& expected = mock_record_calls().back();
 		if (expected.has_output())
-		{
-			FAIL("Mock method only currently supports a single output.");
-			throw std::runtime_error("Mock method only currently supports a single output.");
-		}
+			return MOCK_FAIL("Mock method only currently supports a single output.");
+		output->intern();
 		expected.set_output(output);
 		mock_set_state(MOCK_STATE_RECORD_CALLED);
 		return;
 	}
-	if (g_mock_state != MOCK_STATE_PLAY_WAITING_OUTPUT)
+	mock_trace_instant(MOCK_TRACE_OUTPUT, g_mock_trace_function);
+	if (g_mock_state == MOCK_STATE_PLAY_UNEXPECTED)
+		return;
+	if (g_mock_state == MOCK_STATE_PLAY_FAULT)
 	{
-		FAIL("Mock internal error: state error (mock_output %s).", to_string(g_mock_state));
-		throw std::runtime_error("Mock internal error: state error.");
+		if (g_mock_fault_corrupt && !output->corrupt(mock_random()))
+			return MOCK_FAIL("Mock fault policy cannot corrupt output of type %s.", output->get_type().name());
+		return;
 	}
-	ASSERT(!g_expected_calls.empty());
-	auto& expected = g_expected_calls.front();
-	ASSERT(expected.has_output());
+	if (g_mock_state == MOCK_STATE_PLAY_FUZZ)
+		return mock_use_fuzz_input(*output);
+	if (g_mock_state != MOCK_STATE_PLAY_WAITING_OUTPUT)
+		return MOCK_FAIL("Mock internal error: state error (mock_output %s).", to_string(g_mock_state));
+	if (mock_play_calls().empty())
+		return MOCK_FAIL("Mock internal error: no call to play (mock_output).");
+	auto& expected = mock_play_calls().front();
+	if (!expected.has_output())
+		return MOCK_FAIL("Mock expected call '%s' has no output %s:%zd", expected.get_call_string(), expected.get_filename(), expected.get_line());
 	auto saved_output = expected.get_output();
-	ASSERT(saved_output->get_type() == output->get_type());
+	if (saved_output->get_type() != output->get_type())
+		return MOCK_FAIL("Mock output of expected call '%s' is %s, but the function outputs %s %s:%zd", expected.get_call_string(), saved_output->get_type().name(), output->get_type().name(), expected.get_filename(), expected.get_line());
 	output->set(saved_output);
 	if (expected.has_return_value())
 	{
@@ -443,11 +2048,7 @@ extern void mock_output(const std::shared_ptr<mock_value_wrapper>& output)
 	}
 	else
 	{
-		auto callback = expected.get_callback();
-		g_expected_calls.pop();
-		mock_set_state(MOCK_STATE_IDLE);
-		if (callback)
-			callback();
+		mock_complete_play();
 	}
 }
 
@@ -455,32 +2056,47 @@ extern void mock_return(mock_value_wrapper* result, const char* function_name_st
 {
 	if (g_mock_state == MOCK_STATE_RECORD_CALLED)
 	{
-		ASSERT(!g_expected_calls.empty());
-		auto& expected = g_expected_calls.back();
+		if (mock_record_calls().empty())
+			return MOCK_FAIL("Mock internal error: no call recorded (mock_return).");
+		auto& expected = mock_record_calls().back();
 		if (expected.has_return_type())
-		{
-			FAIL("Mock method has two returns.");
-			throw std::runtime_error("Mock method has two returns.");
-		}
+			return MOCK_FAIL("Mock method has two returns.");
 		expected.set_return_type(result->get_type());
 		mock_set_state(MOCK_STATE_RECORD_CALLED);
 		return;
 	}
-	if (g_mock_state != MOCK_STATE_PLAY_WAITING_RETURN)
+	mock_trace_instant(MOCK_TRACE_RETURN, function_name_str);
+	if (g_mock_state == MOCK_STATE_PLAY_UNEXPECTED)
 	{
-		FAIL("Mock internal error: state error (mock_return %s).", to_string(g_mock_state));
-		throw std::runtime_error("Mock internal error: state error.");
+		mock_set_state(MOCK_STATE_IDLE);
+		return;
+	}
+	if (g_mock_state == MOCK_STATE_PLAY_FUZZ)
+	{
+		mock_set_state(MOCK_STATE_IDLE);
+		return mock_use_fuzz_input(*result);
+	}
+	if (g_mock_state == MOCK_STATE_PLAY_FAULT)
+	{
+		mock_set_state(MOCK_STATE_IDLE);
+		if (!g_mock_fault_return)
+			return;
+		if (g_mock_fault_return->get_type() != result->get_type())
+			return MOCK_FAIL("Mock fault policy for '%s' returns %s, but the function returns %s.", function_name_str, g_mock_fault_return->get_type().name(), result->get_type().name());
+		result->set(g_mock_fault_return);
+		return;
 	}
-	ASSERT(!g_expected_calls.empty());
-	auto& expected = g_expected_calls.front();
-	ASSERT(expected.has_return_value());
-	ASSERT(expected.get_return_type() == result->get_type());
+	if (g_mock_state != MOCK_STATE_PLAY_WAITING_RETURN)
+		return MOCK_FAIL("Mock internal error: state error (mock_return %s).", to_string(g_mock_state));
+	if (mock_play_calls().empty())
+		return MOCK_FAIL("Mock internal error: no call to play (mock_return).");
+	auto& expected = mock_play_calls().front();
+	if (!expected.has_return_value())
+		return MOCK_FAIL("Mock expected call '%s' has no return value %s:%zd", expected.get_call_string(), expected.get_filename(), expected.get_line());
+	if (expected.get_return_type() != result->get_type())
+		return MOCK_FAIL("Mock expected call '%s' returns %s, but the function returns %s %s:%zd", expected.get_call_string(), expected.get_return_type().name(), result->get_type().name(), expected.get_filename(), expected.get_line());
 	result->set(expected.get_return_value());
-	auto callback = expected.get_callback();
-	g_expected_calls.pop();
-	mock_set_state(MOCK_STATE_IDLE);
-	if (callback)
-		callback();
+	mock_complete_play();
 }
 
 TEST_START(MOCK_START)
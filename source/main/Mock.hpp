@@ -1,240 +1,280 @@
 #pragma once
 
-#ifndef __cplusplus
-#error Mock library requires c++.
-#endif
-
-#ifndef __GXX_RTTI
-#error Mock library requires run time type information.
-#endif
+#include "MockDefine.hpp"
+#include <functional>
 
-#ifndef TEST
-#error Mock library only runs when testing.
+#if defined(__unix__) || defined(__APPLE__)
+#define MOCK_SHARED_EXPECTATIONS 1
+#else
+#define MOCK_SHARED_EXPECTATIONS 0
 #endif
 
 
-#include <typeinfo>
-#include <vector>
-#include <string>
-#include <iostream>
-#include <functional>
-#include <memory>
-
-
 #define EXPECT(CALL) mock_begin_expect(#CALL, __FILE__, __LINE__); CALL ; mock_end_expect(#CALL)
+#define EXPECT_IN(SEQUENCE, CALL) mock_begin_expect_in(SEQUENCE, #CALL, __FILE__, __LINE__); CALL ; mock_end_expect(#CALL)
 #define _AND_DO(CALL) ; mock_add_callback([=](){ CALL; })
+#define _AND_DO_AFTER_CALLS(COUNT, CALL) ; mock_add_deferred(COUNT, 0, [=](){ CALL; })
+#define _AND_DO_AFTER_MS(MS, CALL) ; mock_add_deferred(0, MS, [=](){ CALL; })
 #define _AND_RETURN(VALUE) ; mock_add_return(mock_allocate_wrapper(VALUE), #VALUE)
+#define _AND_DELAY(MS) ; mock_add_delay(MS)
+#define _AND_LATENCY(LATENCY) ; mock_add_latency(LATENCY)
+#define _AND_SET_ERRNO(ERROR_NUMBER) ; mock_add_error_number(ERROR_NUMBER)
+#if MOCK_EXCEPTIONS
 #define _AND_THROW(EXCEPTION) ; mock_add_exception(mock_allocate_wrapper_simple(EXCEPTION))
+#else
+#define _AND_THROW(EXCEPTION) ; static_assert(MOCK_EXCEPTIONS, "_AND_THROW requires exceptions, use _AND_RETURN or _AND_SET_ERRNO.")
+#endif
 
-#define MOCK_CALL(...) std::vector<std::shared_ptr<mock_value_wrapper>> mock_params = mock_allocate_wrappers(__VA_ARGS__); mock_call(mock_params, __PRETTY_FUNCTION__)
-#define MOCK_OUTPUT(X) mock_output_typed(X)
-#define MOCK_RETURN(TYPE) mock_value_type<TYPE> mock_result; mock_return(&mock_result, __PRETTY_FUNCTION__); return mock_result.get()
+#define _AND_RETURN_PENDING(PENDING) ; mock_add_return(mock_allocate_wrapper((PENDING).state()), #PENDING)
+
+#define MOCK_WRAP(RETURN_TYPE, NAME, PARAMS, ARGS) \
+	extern "C" RETURN_TYPE __real_##NAME PARAMS; \
+	static MockWrap mock_wrap_##NAME(#NAME); \
+	extern "C" RETURN_TYPE __wrap_##NAME PARAMS \
+	{ \
+		if (mock_wrap_passes_through(mock_wrap_##NAME)) \
+		{ \
+			if (mock_wrap_##NAME.get_mode() == MOCK_WRAP_SPY) \
+				mock_spy(mock_allocate_wrappers ARGS, #NAME); \
+			return __real_##NAME ARGS; \
+		} \
+		mock_call(mock_allocate_wrappers ARGS, #NAME); \
+		mock_value_type<RETURN_TYPE> mock_result; \
+		mock_return(&mock_result, #NAME); \
+		return mock_result.get(); \
+	}
+#define MOCK_WRAP_VOID(NAME, PARAMS, ARGS) \
+	extern "C" void __real_##NAME PARAMS; \
+	static MockWrap mock_wrap_##NAME(#NAME); \
+	extern "C" void __wrap_##NAME PARAMS \
+	{ \
+		if (mock_wrap_passes_through(mock_wrap_##NAME)) \
+		{ \
+			if (mock_wrap_##NAME.get_mode() == MOCK_WRAP_SPY) \
+				mock_spy(mock_allocate_wrappers ARGS, #NAME); \
+			return __real_##NAME ARGS; \
+		} \
+		mock_call(mock_allocate_wrappers ARGS, #NAME); \
+	}
+#define MOCK_FUZZ_TARGET(CALL) extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) { return mock_fuzz_one(data, size, [&]() { CALL; }); }
+#define MOCK_RETURN_PENDING(TYPE, CONTINUATION) mock_value_type<std::shared_ptr<mock_pending_state>> mock_result; mock_return(&mock_result, __PRETTY_FUNCTION__); mock_attach_pending<TYPE>(mock_result.get(), CONTINUATION)
 
 
-class mock_value_wrapper
-{
-public:
-	virtual ~mock_value_wrapper() = default;
+typedef void (*mock_failure_handler)(const char* message);
 
-	virtual const std::type_info& get_type() const = 0;
-	virtual void write(std::ostream&) const = 0;
-	virtual bool equals(const std::shared_ptr<mock_value_wrapper>&) const = 0;
-	virtual bool set(const std::shared_ptr<mock_value_wrapper>&) = 0;
-	virtual void throw_exception() const = 0;
-};
 
-template <typename T>
-class mock_value_simple_type : public mock_value_wrapper
+// Real time a played call takes, spent in a calibrated busy-wait so benchmarks of the
+// code under test see the cost of the mocked device.  Histogram buckets are pairs of
+// latency and relative weight.
+class MockLatency
 {
 public:
-	mock_value_simple_type()
-		: m_value()
-	{
-	}
-
-	mock_value_simple_type(const T& value)
-		: m_value(value)
-	{
-	}
-
-	virtual const std::type_info& get_type() const override
-	{
-		return typeid(T);
-	}
+	MockLatency();
 
-	virtual void write(std::ostream& out) const override
-	{
-		throw std::runtime_error("not implemented");
-	}
+	static MockLatency fixed(uint64_t ns);
+	static MockLatency uniform(uint64_t min_ns, uint64_t max_ns);
+	static MockLatency histogram(const std::vector<std::pair<uint64_t, uint64_t>>& buckets);
 
-	virtual bool equals(const std::shared_ptr<mock_value_wrapper>& second) const override
-	{
-		throw std::runtime_error("not implemented");
-	}
+	bool is_none() const { return m_values.empty(); }
+	uint64_t sample(uint64_t random) const;
 
-	virtual bool set(const std::shared_ptr<mock_value_wrapper>& second) override
-	{
-		if (this->get_type() != second->get_type())
-			return false;
-		const mock_value_simple_type<T>* second_t = (const mock_value_simple_type*)second.get();
-		m_value = second_t->get();
-		return true;
-	}
-
-	virtual void throw_exception() const override
-	{
-		throw m_value;
-	}
+private:
+	bool m_uniform;
+	std::vector<uint64_t> m_values;
+	std::vector<uint64_t> m_weights;
+};
 
-	T get() const
-	{
-		return m_value;
-	}
+enum MockWrapMode
+{
+	MOCK_WRAP_REAL,
+	MOCK_WRAP_MOCK,
+	MOCK_WRAP_SPY,
+};
 
-	void get(T& value) const
-	{
-		value = m_value;
-	}
+// A function interposed with the GNU linker's --wrap=NAME option by MOCK_WRAP.  Calls
+// go to __real_NAME, to the mock, or are logged by mock_spy and then go to
+// __real_NAME.  Every wrap starts as MOCK_WRAP_REAL after mock_reset.  Mocked and
+// spied calls are both named NAME, as the function is extern "C" and has no overloads.
+class MockWrap
+{
+public:
+	explicit MockWrap(const char* name);
 
-	void set(const T& value)
-	{
-		m_value = value;
-	}
+	const char* get_name() const { return m_name; }
+	MockWrapMode get_mode() const { return m_mode; }
+	void set_mode(MockWrapMode mode) { m_mode = mode; }
+	MockWrap* get_next() const { return m_next; }
 
 private:
-	T m_value;
+	const char* m_name;
+	MockWrapMode m_mode;
+	MockWrap* m_next;
 };
 
-template <typename T>
-class mock_value_type : public mock_value_simple_type<T>
+// Faults injected into every call of one mocked function, which then no longer plays
+// expected calls.  A fault starts on the scheduled call indices or with probability
+// rate on any other call, and lasts for burst calls.  Other calls return the nominal
+// value; faulted calls return the fault value, throw, or corrupt their output.
+class MockFaultPolicy
 {
 public:
-	mock_value_type()
-	{
-	}
+	MockFaultPolicy();
+
+	MockFaultPolicy& set_rate(double rate);
+	MockFaultPolicy& set_burst(uint64_t burst);
+	MockFaultPolicy& set_schedule(const std::vector<uint64_t>& calls);
+	MockFaultPolicy& set_corrupt_output(bool corrupt);
 
-	mock_value_type(const T& value)
-		: mock_value_simple_type<T>(value)
+	template <typename T>
+	MockFaultPolicy& set_return(const T& value)
 	{
+		m_return = mock_allocate_wrapper(value);
+		return *this;
 	}
 
-	virtual void write(std::ostream& out) const override
+	template <typename T>
+	MockFaultPolicy& set_fault_return(const T& value)
 	{
-		out << this->get();
+		m_fault_return = mock_allocate_wrapper(value);
+		return *this;
 	}
 
-	virtual bool equals(const std::shared_ptr<mock_value_wrapper>& second) const override
+#if MOCK_EXCEPTIONS
+	template <typename T>
+	MockFaultPolicy& set_fault_exception(const T& exception)
 	{
-		if (this->get_type() != second->get_type())
-			return false;
-		const mock_value_type<T>* second_t = (const mock_value_type*)second.get();
-		return (this->get() == second_t->get());
+		m_fault_exception = mock_allocate_wrapper_simple(exception);
+		return *this;
 	}
+#endif
+
+	double get_rate() const { return m_rate; }
+	uint64_t get_burst() const { return m_burst; }
+	const std::vector<uint64_t>& get_schedule() const { return m_schedule; }
+	bool get_corrupt_output() const { return m_corrupt_output; }
+	const std::shared_ptr<mock_value_wrapper>& get_return() const { return m_return; }
+	const std::shared_ptr<mock_value_wrapper>& get_fault_return() const { return m_fault_return; }
+	const std::shared_ptr<mock_value_wrapper>& get_fault_exception() const { return m_fault_exception; }
+
+private:
+	double m_rate;
+	uint64_t m_burst;
+	std::vector<uint64_t> m_schedule;
+	bool m_corrupt_output;
+	std::shared_ptr<mock_value_wrapper> m_return;
+	std::shared_ptr<mock_value_wrapper> m_fault_return;
+	std::shared_ptr<mock_value_wrapper> m_fault_exception;
 };
 
-template <>
-class mock_value_simple_type<const char*> : public mock_value_simple_type<std::string>
+// A faulted call, numbered from zero among the calls of its function.
+struct MockFault
 {
-public:
-	mock_value_simple_type()
-	{
-	}
-
-	mock_value_simple_type(const char* value)
-		: mock_value_simple_type<std::string>(value)
-	{
-	}
+	std::string function;
+	uint64_t call;
 };
 
-template <size_t SIZE>
-class mock_value_simple_type<char[SIZE]> : public mock_value_simple_type<std::string>
+class MockFunctionCall;
+
+// An immutable list of recorded expectations.  Copies share the same calls, and each
+// mock_expect_script appends them to the expected calls without re-recording.
+class MockScript
 {
 public:
-	mock_value_simple_type()
-	{
-	}
+	MockScript();
+	explicit MockScript(const std::shared_ptr<const std::vector<MockFunctionCall>>& calls);
 
-	mock_value_simple_type(const char* value)
-		: mock_value_simple_type<std::string>(value)
-	{
-	}
-};
+	size_t size() const;
+	const std::vector<MockFunctionCall>& get() const { return *m_calls; }
 
-template <typename T>
-std::shared_ptr<mock_value_wrapper> mock_allocate_wrapper_simple(const T& value)
-{
-	return std::make_shared<mock_value_simple_type<T>>(value);
-}
+private:
+	std::shared_ptr<const std::vector<MockFunctionCall>> m_calls;
+};
 
-template <typename T>
-std::shared_ptr<mock_value_wrapper> mock_allocate_wrapper(const T& value)
-{
-	return std::make_shared<mock_value_type<T>>(value);
-}
 
-template <typename T>
-mock_value_simple_type<T> mock_construct_wrapper_simple(const T& value)
+// Result of a mocked asynchronous operation.  The mocked function attaches a
+// continuation when it is called, the test completes it later, and mock_run_pending
+// delivers completed results in the order they were completed.
+class mock_pending_state : public std::enable_shared_from_this<mock_pending_state>
 {
-	return mock_value_simple_type<T>(value);
-}
+public:
+	explicit mock_pending_state(const std::type_info& type);
 
-inline void mock_allocate_wrappers_to_vector(std::vector<std::shared_ptr<mock_value_wrapper>>& result)
-{
-}
+	const std::type_info& get_type() const { return m_type; }
+	bool is_attached() const { return (bool)m_continuation; }
+	bool is_completed() const { return (bool)m_value; }
 
-template <typename T, typename... TS>
-void mock_allocate_wrappers_to_vector(std::vector<std::shared_ptr<mock_value_wrapper>>& result, const T& value, TS... ts)
-{
-	result.push_back(mock_allocate_wrapper(value));
-	mock_allocate_wrappers_to_vector(result, ts...);
-}
+	void attach(const std::type_info& type, std::function<void(const std::shared_ptr<mock_value_wrapper>&)> continuation);
+	void complete(const std::shared_ptr<mock_value_wrapper>& value);
+	void deliver();
 
-template <typename... TS>
-std::vector<std::shared_ptr<mock_value_wrapper>> mock_allocate_wrappers(TS... ts)
-{
-	std::vector<std::shared_ptr<mock_value_wrapper>> result;
-	mock_allocate_wrappers_to_vector(result, ts...);
-	return result;
-}
+private:
+	const std::type_info& m_type;
+	std::shared_ptr<mock_value_wrapper> m_value;
+	std::function<void(const std::shared_ptr<mock_value_wrapper>&)> m_continuation;
+};
 
-class MockData
+template <typename T>
+class MockPending
 {
 public:
-	MockData(const uint8_t* ptr, size_t size);
-	MockData(uint8_t* ptr, size_t size);
-	MockData(const char* ptr, size_t size);
-	MockData(char* ptr, size_t size);
+	MockPending()
+		: m_state(std::make_shared<mock_pending_state>(typeid(T)))
+	{
+	}
 
-	MockData& operator=(const MockData& second);
+	bool is_attached() const { return m_state->is_attached(); }
+	bool is_completed() const { return m_state->is_completed(); }
 
-	bool operator==(const MockData& second) const;
+	void complete(const T& value) { m_state->complete(mock_allocate_wrapper_simple(value)); }
 
-	std::vector<uint8_t> get() const { return m_data; }
+	const std::shared_ptr<mock_pending_state>& state() const { return m_state; }
 
 private:
-	uint8_t* m_pointer;
-	std::vector<uint8_t> m_data;
+	std::shared_ptr<mock_pending_state> m_state;
 };
 
-extern std::ostream& operator<<(std::ostream& out, const MockData& data);
-
-
-template <typename T>
-void mock_output_typed(T& t)
+template <typename T, typename F>
+void mock_attach_pending(const std::shared_ptr<mock_pending_state>& state, F continuation)
 {
-	auto result = std::make_shared<mock_value_simple_type<T>>(t);
-	mock_output(result);
-	result->get(t);
+	if (!state)
+		return;
+	state->attach(typeid(T), [continuation](const std::shared_ptr<mock_value_wrapper>& value) {
+		continuation(((const mock_value_simple_type<T>*)value.get())->get());
+	});
 }
 
 
+extern void mock_set_retain_hashed_data(bool retain);
+extern void mock_set_collect_all(bool collect_all);
+extern void mock_set_trace(const char* path, size_t capacity = 65536);
+extern void mock_set_failure_handler(mock_failure_handler handler);
+extern bool mock_failed();
 extern void mock_reset();
 extern void mock_verify();
+extern MockScript mock_record_script(std::function<void()> record);
+extern void mock_expect_script(const MockScript& script);
+extern void mock_share_expectations();
 extern void mock_begin_expect(const char* call_str, const char* file_name, size_t line);
+extern void mock_begin_expect_in(const char* sequence, const char* call_str, const char* file_name, size_t line);
 extern void mock_end_expect(const char* call_str);
 extern void mock_add_callback(std::function<void()> callback);
+extern void mock_add_delay(uint64_t delay_ms);
+extern uint64_t mock_clock_ms();
+extern void mock_advance_clock(uint64_t delay_ms);
+extern void mock_add_latency(const MockLatency& latency);
+extern void mock_set_default_latency(const MockLatency& latency);
+extern void mock_set_random_seed(uint64_t seed);
+extern void mock_busy_wait_ns(uint64_t ns);
+extern void mock_add_deferred(uint64_t calls, uint64_t delay_ms, std::function<void()> callback);
+extern void mock_add_error_number(int error_number);
+extern bool mock_in_interrupt();
 extern void mock_add_return(const std::shared_ptr<mock_value_wrapper>& value, const char* value_str);
 extern void mock_add_exception(const std::shared_ptr<mock_value_wrapper>& exception);
-extern void mock_call(const std::vector<std::shared_ptr<mock_value_wrapper>>& params, const char* function_name_str);
-extern void mock_output(const std::shared_ptr<mock_value_wrapper>& output);
-extern void mock_return(mock_value_wrapper* result, const char* function_name_str);
+extern size_t mock_run_pending();
+extern void mock_set_wrap_mode(const char* name, MockWrapMode mode);
+extern bool mock_wrap_passes_through(const MockWrap& wrap);
+extern void mock_spy(const std::vector<std::shared_ptr<mock_value_wrapper>>& params, const char* function_name_str);
+extern const std::vector<std::string>& mock_spy_log();
+extern void mock_set_fault_policy(const char* function, const MockFaultPolicy& policy);
+extern const std::vector<MockFault>& mock_fault_log();
+extern int mock_fuzz_one(const uint8_t* data, size_t size, std::function<void()> target);
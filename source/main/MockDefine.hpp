@@ -0,0 +1,579 @@
+#pragma once
+
+// The part of the mock library needed to define mocked functions with MOCK_CALL,
+// MOCK_OUTPUT and MOCK_RETURN.  Tests that set expectations include Mock.hpp.
+
+#ifndef __cplusplus
+#error Mock library requires c++.
+#endif
+
+#ifndef __GXX_RTTI
+#error Mock library requires run time type information.
+#endif
+
+#ifndef TEST
+#error Mock library only runs when testing.
+#endif
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+#define MOCK_EXCEPTIONS 1
+#else
+#define MOCK_EXCEPTIONS 0
+#endif
+
+
+#include <typeinfo>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <memory>
+#include <cstdint>
+#include <type_traits>
+
+
+#define MOCK_CALL(...) std::vector<std::shared_ptr<mock_value_wrapper>> mock_params = mock_allocate_wrappers(__VA_ARGS__); mock_call(mock_params, __PRETTY_FUNCTION__)
+#define MOCK_OUTPUT(X) mock_output_typed(X)
+#define MOCK_RETURN(TYPE) mock_value_type<TYPE> mock_result; mock_return(&mock_result, __PRETTY_FUNCTION__); return mock_result.get()
+
+
+extern void mock_fail(const char* message);
+
+
+class mock_value_wrapper
+{
+public:
+	virtual ~mock_value_wrapper() = default;
+
+	virtual const std::type_info& get_type() const = 0;
+	virtual void write(std::ostream&) const = 0;
+	virtual bool equals(const std::shared_ptr<mock_value_wrapper>&) const = 0;
+	virtual bool set(const std::shared_ptr<mock_value_wrapper>&) = 0;
+	virtual void throw_exception() const = 0;
+	virtual void write_difference(std::ostream&, const std::shared_ptr<mock_value_wrapper>&) const {}
+	virtual void intern() {}
+	virtual bool corrupt(uint64_t random) { return false; }
+	virtual size_t fuzz(const uint8_t* data, size_t size) { return 0; }
+};
+
+template <typename T>
+void mock_intern_value(T& value)
+{
+}
+
+extern void mock_flip_bit(void* data, size_t size, uint64_t random);
+
+// Corrupts a value for a fault policy, returning false for types that cannot be
+// corrupted.
+template <typename T>
+typename std::enable_if<std::is_trivially_copyable<T>::value, bool>::type mock_corrupt_value(T& value, uint64_t random)
+{
+	mock_flip_bit(&value, sizeof(value), random);
+	return true;
+}
+
+template <typename T>
+typename std::enable_if<!std::is_trivially_copyable<T>::value, bool>::type mock_corrupt_value(T& value, uint64_t random)
+{
+	return false;
+}
+
+inline bool mock_corrupt_value(bool& value, uint64_t random)
+{
+	value = !value;
+	return true;
+}
+
+inline bool mock_corrupt_value(std::string& value, uint64_t random)
+{
+	mock_flip_bit(&value[0], value.size(), random);
+	return true;
+}
+
+extern size_t mock_copy_fuzz_bytes(void* value, size_t value_size, const uint8_t* data, size_t size);
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value, size_t>::type mock_fuzz_value(T& value, const uint8_t* data, size_t size)
+{
+	return mock_copy_fuzz_bytes(&value, sizeof(value), data, size);
+}
+
+template <typename T>
+typename std::enable_if<!std::is_arithmetic<T>::value && !std::is_enum<T>::value, size_t>::type mock_fuzz_value(T& value, const uint8_t* data, size_t size)
+{
+	return 0;
+}
+
+inline size_t mock_fuzz_value(bool& value, const uint8_t* data, size_t size)
+{
+	value = (size != 0) && (data[0] & 1);
+	return (size != 0) ? 1 : 0;
+}
+
+template <typename T>
+void mock_write_difference(std::ostream& out, const T& expected, const T& actual)
+{
+}
+
+template <typename T>
+class mock_value_simple_type : public mock_value_wrapper
+{
+public:
+	mock_value_simple_type()
+		: m_value()
+	{
+	}
+
+	mock_value_simple_type(const T& value)
+		: m_value(value)
+	{
+	}
+
+	virtual const std::type_info& get_type() const override;
+	virtual void write(std::ostream& out) const override;
+	virtual bool equals(const std::shared_ptr<mock_value_wrapper>& second) const override;
+	virtual bool set(const std::shared_ptr<mock_value_wrapper>& second) override;
+	virtual void throw_exception() const override;
+	virtual void intern() override;
+	virtual bool corrupt(uint64_t random) override;
+	virtual size_t fuzz(const uint8_t* data, size_t size) override;
+
+	T get() const
+	{
+		return m_value;
+	}
+
+	void get(T& value) const
+	{
+		value = m_value;
+	}
+
+	void set(const T& value)
+	{
+		m_value = value;
+	}
+
+private:
+	T m_value;
+};
+
+// Virtual members are defined out of line so that the explicit instantiations in
+// Mock.cpp keep them out of every file that defines mocks of the common types.
+template <typename T>
+const std::type_info& mock_value_simple_type<T>::get_type() const
+{
+	return typeid(T);
+}
+
+template <typename T>
+void mock_value_simple_type<T>::write(std::ostream& out) const
+{
+	mock_fail("not implemented");
+}
+
+template <typename T>
+bool mock_value_simple_type<T>::equals(const std::shared_ptr<mock_value_wrapper>& second) const
+{
+	mock_fail("not implemented");
+	return false;
+}
+
+template <typename T>
+bool mock_value_simple_type<T>::set(const std::shared_ptr<mock_value_wrapper>& second)
+{
+	if (this->get_type() != second->get_type())
+		return false;
+	const mock_value_simple_type<T>* second_t = (const mock_value_simple_type*)second.get();
+	m_value = second_t->get();
+	return true;
+}
+
+template <typename T>
+void mock_value_simple_type<T>::throw_exception() const
+{
+#if MOCK_EXCEPTIONS
+	throw m_value;
+#else
+	mock_fail("Mock cannot throw without exceptions.");
+#endif
+}
+
+template <typename T>
+void mock_value_simple_type<T>::intern()
+{
+	mock_intern_value(m_value);
+}
+
+template <typename T>
+bool mock_value_simple_type<T>::corrupt(uint64_t random)
+{
+	return mock_corrupt_value(m_value, random);
+}
+
+template <typename T>
+size_t mock_value_simple_type<T>::fuzz(const uint8_t* data, size_t size)
+{
+	return mock_fuzz_value(m_value, data, size);
+}
+
+template <typename T>
+class mock_value_type : public mock_value_simple_type<T>
+{
+public:
+	mock_value_type()
+	{
+	}
+
+	mock_value_type(const T& value)
+		: mock_value_simple_type<T>(value)
+	{
+	}
+
+	virtual void write(std::ostream& out) const override;
+	virtual bool equals(const std::shared_ptr<mock_value_wrapper>& second) const override;
+	virtual void write_difference(std::ostream& out, const std::shared_ptr<mock_value_wrapper>& second) const override;
+};
+
+template <typename T>
+void mock_value_type<T>::write(std::ostream& out) const
+{
+	out << this->get();
+}
+
+template <typename T>
+bool mock_value_type<T>::equals(const std::shared_ptr<mock_value_wrapper>& second) const
+{
+	if (this->get_type() != second->get_type())
+		return false;
+	const mock_value_type<T>* second_t = (const mock_value_type*)second.get();
+	return (this->get() == second_t->get());
+}
+
+template <typename T>
+void mock_value_type<T>::write_difference(std::ostream& out, const std::shared_ptr<mock_value_wrapper>& second) const
+{
+	if (this->get_type() != second->get_type())
+		return;
+	const mock_value_type<T>* second_t = (const mock_value_type*)second.get();
+	mock_write_difference(out, this->get(), second_t->get());
+}
+
+template <>
+class mock_value_simple_type<const char*> : public mock_value_simple_type<std::string>
+{
+public:
+	mock_value_simple_type()
+	{
+	}
+
+	mock_value_simple_type(const char* value)
+		: mock_value_simple_type<std::string>(value)
+	{
+	}
+};
+
+template <size_t SIZE>
+class mock_value_simple_type<char[SIZE]> : public mock_value_simple_type<std::string>
+{
+public:
+	mock_value_simple_type()
+	{
+	}
+
+	mock_value_simple_type(const char* value)
+		: mock_value_simple_type<std::string>(value)
+	{
+	}
+};
+
+template <typename T>
+std::shared_ptr<mock_value_wrapper> mock_allocate_wrapper_simple(const T& value)
+{
+	return std::make_shared<mock_value_simple_type<T>>(value);
+}
+
+template <typename T>
+std::shared_ptr<mock_value_wrapper> mock_allocate_wrapper(const T& value)
+{
+	return std::make_shared<mock_value_type<T>>(value);
+}
+
+template <typename T>
+mock_value_simple_type<T> mock_construct_wrapper_simple(const T& value)
+{
+	return mock_value_simple_type<T>(value);
+}
+
+template <typename... TS>
+std::vector<std::shared_ptr<mock_value_wrapper>> mock_allocate_wrappers(TS... ts)
+{
+	std::vector<std::shared_ptr<mock_value_wrapper>> result;
+	result.reserve(sizeof...(ts));
+	(result.push_back(mock_allocate_wrapper(ts)), ...);
+	return result;
+}
+
+enum MockDataMode
+{
+	MOCK_DATA_BYTES,
+	MOCK_DATA_HASH_ONLY,
+};
+
+// Buffer parameter or output.  In MOCK_DATA_HASH_ONLY mode only the size and a content
+// hash are kept, unless mock_set_retain_hashed_data(true) asks for the bytes as well.
+class MockData
+{
+public:
+	MockData(const uint8_t* ptr, size_t size, MockDataMode mode = MOCK_DATA_BYTES);
+	MockData(uint8_t* ptr, size_t size, MockDataMode mode = MOCK_DATA_BYTES);
+	MockData(const char* ptr, size_t size, MockDataMode mode = MOCK_DATA_BYTES);
+	MockData(char* ptr, size_t size, MockDataMode mode = MOCK_DATA_BYTES);
+
+	MockData& operator=(const MockData& second);
+
+	bool operator==(const MockData& second) const;
+
+	void intern();
+	bool corrupt(uint64_t random);
+	size_t fuzz(const uint8_t* data, size_t size);
+
+	bool has_data() const { return (bool)m_data; }
+	const std::vector<uint8_t>& get() const;
+	size_t size() const { return m_size; }
+	uint64_t get_hash() const { return m_hash; }
+
+private:
+	uint8_t* m_pointer;
+	std::shared_ptr<const std::vector<uint8_t>> m_data;
+	size_t m_size;
+	uint64_t m_hash;
+};
+
+extern std::ostream& operator<<(std::ostream& out, const MockData& data);
+extern void mock_intern_value(MockData& data);
+extern bool mock_corrupt_value(MockData& data, uint64_t random);
+extern size_t mock_fuzz_value(MockData& data, const uint8_t* bytes, size_t size);
+
+extern uint64_t mock_hash_bytes(const void* data, size_t size);
+extern std::shared_ptr<const void> mock_intern_bytes(const std::type_info& type, const std::shared_ptr<const void>& data, const void* bytes, size_t size, uint64_t hash);
+
+// Vectors whose elements are equal exactly when their bytes are, and whose elements
+// are stored as an array; std::vector<bool> packs its elements into bits.
+template <typename T>
+struct mock_vector_is_bytes : std::integral_constant<bool, std::has_unique_object_representations<T>::value && !std::is_same<T, bool>::value>
+{
+};
+
+template <typename T>
+typename std::enable_if<mock_vector_is_bytes<T>::value, uint64_t>::type mock_hash_vector(const std::vector<T>& data)
+{
+	return mock_hash_bytes(data.data(), data.size() * sizeof(T));
+}
+
+template <typename T>
+typename std::enable_if<!mock_vector_is_bytes<T>::value, uint64_t>::type mock_hash_vector(const std::vector<T>& data)
+{
+	return 0;
+}
+
+template <typename T>
+typename std::enable_if<mock_vector_is_bytes<T>::value>::type mock_intern_vector(std::shared_ptr<const std::vector<T>>& data, uint64_t hash)
+{
+	data = std::static_pointer_cast<const std::vector<T>>(mock_intern_bytes(typeid(std::vector<T>), data, data->data(), data->size() * sizeof(T), hash));
+}
+
+template <typename T>
+typename std::enable_if<!mock_vector_is_bytes<T>::value>::type mock_intern_vector(std::shared_ptr<const std::vector<T>>& data, uint64_t hash)
+{
+}
+
+// Elements of a std::vector parameter, output or return held in shared, immutable
+// storage.  Vectors whose elements compare equal exactly when their bytes do are
+// hashed and interned in the same pool as MockData; others are only compared.
+template <typename T>
+class MockVector
+{
+public:
+	MockVector()
+		: m_data(std::make_shared<const std::vector<T>>())
+		, m_hash(mock_hash_vector(*m_data))
+	{
+	}
+
+	MockVector(const std::vector<T>& data)
+		: m_data(std::make_shared<const std::vector<T>>(data))
+		, m_hash(mock_hash_vector(*m_data))
+	{
+	}
+
+	bool operator==(const MockVector& second) const
+	{
+		if (m_hash != second.m_hash)
+			return false;
+		if (m_data == second.m_data)
+			return true;
+		return (*m_data == *second.m_data);
+	}
+
+	void intern()
+	{
+		mock_intern_vector(m_data, m_hash);
+	}
+
+	// Corrupts one element, chosen by the random value.
+	bool corrupt(uint64_t random)
+	{
+		if (m_data->empty())
+			return true;
+		std::vector<T> data(*m_data);
+		size_t index = random % data.size();
+		T element = data[index];
+		if (!mock_corrupt_value(element, random / data.size()))
+			return false;
+		data[index] = element;
+		m_data = std::make_shared<const std::vector<T>>(std::move(data));
+		m_hash = mock_hash_vector(*m_data);
+		return true;
+	}
+
+	const std::vector<T>& get() const { return *m_data; }
+	operator const std::vector<T>&() const { return *m_data; }
+
+private:
+	std::shared_ptr<const std::vector<T>> m_data;
+	uint64_t m_hash;
+};
+
+template <typename T>
+void mock_intern_value(MockVector<T>& value)
+{
+	value.intern();
+}
+
+template <typename T>
+bool mock_corrupt_value(MockVector<T>& value, uint64_t random)
+{
+	return value.corrupt(random);
+}
+
+template <typename T>
+void mock_write_element(std::ostream& out, const T& value)
+{
+	out << value;
+}
+
+inline void mock_write_element(std::ostream& out, uint8_t value)
+{
+	out << (int)value;
+}
+
+inline void mock_write_element(std::ostream& out, int8_t value)
+{
+	out << (int)value;
+}
+
+template <typename T>
+std::ostream& operator<<(std::ostream& out, const MockVector<T>& data)
+{
+	out << "{";
+	for (size_t i = 0; i < data.get().size(); i++)
+	{
+		if (i != 0)
+			out << ", ";
+		mock_write_element(out, data.get()[i]);
+	}
+	out << "}";
+	return out;
+}
+
+template <typename T>
+class mock_value_simple_type<std::vector<T>> : public mock_value_simple_type<MockVector<T>>
+{
+public:
+	mock_value_simple_type()
+	{
+	}
+
+	mock_value_simple_type(const std::vector<T>& value)
+		: mock_value_simple_type<MockVector<T>>(value)
+	{
+	}
+
+	using mock_value_simple_type<MockVector<T>>::get;
+
+	void get(std::vector<T>& value) const
+	{
+		value = this->get().get();
+	}
+};
+
+// Numeric array parameter matched element by element within an absolute and relative
+// tolerance.  Elements whose mask byte is zero are not compared.  Implemented for
+// float, double and the 8, 16 and 32 bit integer types.
+template <typename T>
+class MockArray
+{
+public:
+	MockArray(const T* ptr, size_t size, double abs_tolerance = 0, double rel_tolerance = 0);
+
+	MockArray& set_mask(const uint8_t* mask);
+
+	bool operator==(const MockArray& second) const;
+
+	bool find_worst(const MockArray& actual, size_t& index, double& deviation, size_t& mismatches) const;
+
+	const std::vector<T>& get() const { return m_data; }
+
+private:
+	std::vector<T> m_data;
+	std::vector<uint8_t> m_mask;
+	double m_abs_tolerance;
+	double m_rel_tolerance;
+};
+
+template <typename T>
+extern std::ostream& operator<<(std::ostream& out, const MockArray<T>& data);
+
+template <typename T>
+extern void mock_write_difference(std::ostream& out, const MockArray<T>& expected, const MockArray<T>& actual);
+
+
+extern void mock_call(const std::vector<std::shared_ptr<mock_value_wrapper>>& params, const char* function_name_str);
+extern void mock_output(const std::shared_ptr<mock_value_wrapper>& output);
+extern void mock_return(mock_value_wrapper* result, const char* function_name_str);
+
+template <typename T>
+void mock_output_typed(T& t)
+{
+	auto result = std::make_shared<mock_value_simple_type<T>>(t);
+	mock_output(result);
+	result->get(t);
+}
+
+
+// Wrappers for the common types are instantiated once in Mock.cpp rather than in
+// every file that defines mocks.
+#define MOCK_VALUE_TYPE_EXTERN(TYPE) \
+	extern template class mock_value_simple_type<TYPE>; \
+	extern template class mock_value_type<TYPE>; \
+	extern template std::shared_ptr<mock_value_wrapper> mock_allocate_wrapper(const TYPE& value); \
+	extern template void mock_output_typed(TYPE& t)
+
+MOCK_VALUE_TYPE_EXTERN(bool);
+MOCK_VALUE_TYPE_EXTERN(char);
+MOCK_VALUE_TYPE_EXTERN(signed char);
+MOCK_VALUE_TYPE_EXTERN(unsigned char);
+MOCK_VALUE_TYPE_EXTERN(short);
+MOCK_VALUE_TYPE_EXTERN(unsigned short);
+MOCK_VALUE_TYPE_EXTERN(int);
+MOCK_VALUE_TYPE_EXTERN(unsigned int);
+MOCK_VALUE_TYPE_EXTERN(long);
+MOCK_VALUE_TYPE_EXTERN(unsigned long);
+MOCK_VALUE_TYPE_EXTERN(long long);
+MOCK_VALUE_TYPE_EXTERN(unsigned long long);
+MOCK_VALUE_TYPE_EXTERN(float);
+MOCK_VALUE_TYPE_EXTERN(double);
+MOCK_VALUE_TYPE_EXTERN(std::string);
+extern template class mock_value_type<const char*>;
+extern template std::shared_ptr<mock_value_wrapper> mock_allocate_wrapper(const char* const& value);
+extern template std::shared_ptr<mock_value_wrapper> mock_allocate_wrapper(const MockData& value);
+extern template void mock_output_typed(MockData& t);
@@ -1,6 +1,15 @@
 #include "Test.hpp"
 #include <memory>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
 #include "Mock.hpp"
+#if MOCK_SHARED_EXPECTATIONS
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 
 TEST_CASE(mock_value_type_contructor_happy_case)
@@ -86,6 +95,27 @@ static void MockTestHx(const char* data, size_t size)
 	MOCK_CALL(MockData(data, size));
 }
 
+static void MockTestMx(const uint8_t* data, size_t size)
+{
+	MOCK_CALL(MockData(data, size, MOCK_DATA_HASH_ONLY));
+}
+
+static void MockTestVx(const std::vector<uint8_t>& data)
+{
+	MOCK_CALL(data);
+}
+
+static std::vector<int> MockTestWx(const std::vector<int>& data)
+{
+	MOCK_CALL(data);
+	MOCK_RETURN(std::vector<int>);
+}
+
+static void MockTestBx(const std::vector<bool>& flags)
+{
+	MOCK_CALL(flags);
+}
+
 static void MockTestIx(int* out)
 {
 	MOCK_CALL();
@@ -357,3 +387,1426 @@ TEST_CASE(MOCK_OUT_Data)
 	ASSERT(test_case.Run());
 }
 
+
+static void MockTestKx(const float* samples, size_t count)
+{
+	MOCK_CALL(MockArray<float>(samples, count, 0.01));
+}
+
+static void MockTestLx(const int16_t* samples, const uint8_t* mask, size_t count)
+{
+	MOCK_CALL(MockArray<int16_t>(samples, count, 2).set_mask(mask));
+}
+
+TEST_CASE(MockArray_Tolerance)
+{
+	float expected[4] = { 1.0f, 2.0f, 3.0f, 4.0f };
+	float close[4] = { 1.005f, 1.995f, 3.0f, 4.009f };
+	float far[4] = { 1.0f, 2.0f, 3.5f, 4.0f };
+
+	ASSERT(MockArray<float>(expected, 4, 0.01) == MockArray<float>(close, 4));
+	ASSERT(!(MockArray<float>(expected, 4, 0.01) == MockArray<float>(far, 4)));
+	ASSERT(!(MockArray<float>(expected, 4, 0.01) == MockArray<float>(close, 3)));
+	ASSERT(MockArray<float>(expected, 4, 0, 0.2) == MockArray<float>(far, 4));
+
+	size_t index;
+	double deviation;
+	size_t mismatches;
+	ASSERT(MockArray<float>(expected, 4, 0.01).find_worst(MockArray<float>(far, 4), index, deviation, mismatches));
+	ASSERT(index == 2);
+	ASSERT(deviation == 0.5);
+	ASSERT(mismatches == 1);
+}
+
+TEST_CASE(MockArray_WorstOutOfTolerance)
+{
+	float expected[2] = { 1000.0f, 1.0f };
+	float actual[2] = { 1005.0f, 1.5f };
+
+	std::ostringstream out;
+	mock_write_difference(out, MockArray<float>(expected, 2, 0, 0.01), MockArray<float>(actual, 2));
+	ASSERT(out.str() == "1 elements out of tolerance, worst deviation 0.5 at index 1 (expected 1, actual 1.5)");
+}
+
+TEST_CASE(MockArray_HappyCase)
+{
+	auto test = [] {
+		float expected[3] = { 0.5f, -0.25f, 8.0f };
+		EXPECT(MockTestKx(expected, 3));
+
+		float actual[3] = { 0.501f, -0.249f, 8.0f };
+		MockTestKx(actual, 3);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MockArray_OutOfTolerance)
+{
+	auto test = [] {
+		float expected[3] = { 0.5f, -0.25f, 8.0f };
+		EXPECT(MockTestKx(expected, 3));
+
+		float actual[3] = { 0.5f, -0.25f, 8.5f };
+		MockTestKx(actual, 3);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+TEST_CASE(MockArray_Mask)
+{
+	auto test = [] {
+		int16_t expected[4] = { 100, 200, 300, 400 };
+		uint8_t mask[4] = { 1, 0, 1, 1 };
+		EXPECT(MockTestLx(expected, mask, 4));
+
+		int16_t actual[4] = { 101, -7, 298, 400 };
+		MockTestLx(actual, mask, 4);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MockData_Intern)
+{
+	char page_a[4] = { 1, 2, 3, 4 };
+	char page_b[4] = { 1, 2, 3, 4 };
+	char page_c[4] = { 1, 2, 3, 5 };
+
+	MockData data_a(page_a, 4);
+	MockData data_b(page_b, 4);
+	MockData data_c(page_c, 4);
+	ASSERT(&data_a.get() != &data_b.get());
+	ASSERT(data_a.get_hash() == data_b.get_hash());
+	ASSERT(data_a.get_hash() != data_c.get_hash());
+
+	mock_intern_value(data_a);
+	mock_intern_value(data_b);
+	mock_intern_value(data_c);
+	ASSERT(&data_a.get() == &data_b.get());
+	ASSERT(&data_a.get() != &data_c.get());
+	ASSERT(data_a == data_b);
+	ASSERT(!(data_a == data_c));
+}
+
+TEST_CASE(MOCK_MockData_RepeatedPayload)
+{
+	auto test = [] {
+		for (size_t i = 0; i < 100; i++)
+		{
+			EXPECT(MockTestHx("PAGE", 4));
+		}
+
+		for (size_t i = 0; i < 100; i++)
+			MockTestHx("PAGE", 4);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MockVector_Intern)
+{
+	MockVector<int> vector_a(std::vector<int>{ 1, 2, 3 });
+	MockVector<int> vector_b(std::vector<int>{ 1, 2, 3 });
+	MockVector<int> vector_c(std::vector<int>{ 1, 2, 4 });
+	MockVector<uint8_t> bytes(std::vector<uint8_t>{ 1, 2, 3, 4 });
+	char page[4] = { 1, 2, 3, 4 };
+	MockData data(page, 4);
+	ASSERT(&vector_a.get() != &vector_b.get());
+
+	mock_intern_value(vector_a);
+	mock_intern_value(vector_b);
+	mock_intern_value(vector_c);
+	mock_intern_value(bytes);
+	mock_intern_value(data);
+	ASSERT(&vector_a.get() == &vector_b.get());
+	ASSERT(&vector_a.get() != &vector_c.get());
+	ASSERT(vector_a == vector_b);
+	ASSERT(!(vector_a == vector_c));
+	ASSERT(&bytes.get() == &data.get());
+
+	MockVector<std::string> names_a(std::vector<std::string>{ "a", "b" });
+	MockVector<std::string> names_b(std::vector<std::string>{ "a", "b" });
+	mock_intern_value(names_a);
+	mock_intern_value(names_b);
+	ASSERT(&names_a.get() != &names_b.get());
+	ASSERT(names_a == names_b);
+
+	std::ostringstream out;
+	out << vector_a << " " << bytes;
+	ASSERT(out.str() == "{1, 2, 3} {1, 2, 3, 4}");
+}
+
+TEST_CASE(MOCK_Vector_RepeatedPayload)
+{
+	auto test = [] {
+		for (size_t i = 0; i < 100; i++)
+		{
+			EXPECT(MockTestVx(std::vector<uint8_t>({ 'P', 'A', 'G', 'E' })));
+		}
+		EXPECT(MockTestWx(std::vector<int>({ 1, 2 })))_AND_RETURN(std::vector<int>({ 3, 4, 5 }));
+
+		for (size_t i = 0; i < 100; i++)
+			MockTestVx(std::vector<uint8_t>{ 'P', 'A', 'G', 'E' });
+		ASSERT(MockTestWx(std::vector<int>{ 1, 2 }) == std::vector<int>({ 3, 4, 5 }));
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Vector_Bool)
+{
+	auto test = [] {
+		EXPECT(MockTestBx(std::vector<bool>({ true, false, true })));
+		MockTestBx(std::vector<bool>({ true, false, true }));
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MockData_HashOnly)
+{
+	uint8_t image[1000];
+	for (size_t i = 0; i < sizeof(image); i++)
+		image[i] = (uint8_t)(i * 7);
+
+	MockData hashed(image, sizeof(image), MOCK_DATA_HASH_ONLY);
+	MockData full(image, sizeof(image));
+	ASSERT(!hashed.has_data());
+	ASSERT(hashed.get().empty());
+	ASSERT(hashed.size() == sizeof(image));
+	ASSERT(full.has_data());
+	ASSERT(hashed == full);
+
+	image[999]++;
+	ASSERT(!(hashed == MockData(image, sizeof(image), MOCK_DATA_HASH_ONLY)));
+	ASSERT(!(hashed == MockData(image, sizeof(image) - 1, MOCK_DATA_HASH_ONLY)));
+
+	mock_set_retain_hashed_data(true);
+	MockData retained(image, sizeof(image), MOCK_DATA_HASH_ONLY);
+	mock_set_retain_hashed_data(false);
+	ASSERT(retained.has_data());
+	ASSERT(retained.get().size() == sizeof(image));
+}
+
+TEST_CASE(MOCK_MockData_HashOnly)
+{
+	auto test = [] {
+		std::vector<uint8_t> image(1 << 20, 0x5A);
+		EXPECT(MockTestMx(image.data(), image.size()));
+
+		std::vector<uint8_t> actual(image);
+		MockTestMx(actual.data(), actual.size());
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_MockData_HashOnlyMismatch)
+{
+	auto test = [] {
+		std::vector<uint8_t> image(1 << 20, 0x5A);
+		EXPECT(MockTestMx(image.data(), image.size()));
+
+		std::vector<uint8_t> actual(image);
+		actual[12345] = 0;
+		MockTestMx(actual.data(), actual.size());
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+static const MockScript& MockTestBringUpScript()
+{
+	static MockScript script = mock_record_script([] {
+		EXPECT(MockTestFx(1, 2, 3))_AND_RETURN(10);
+		EXPECT(MockTestGx(3, 4));
+		EXPECT(MockTestFx(4, 5, 6))_AND_RETURN(11);
+	});
+	return script;
+}
+
+TEST_CASE(MOCK_Script_HappyCase)
+{
+	auto test = [] {
+		mock_expect_script(MockTestBringUpScript());
+		EXPECT(MockTestGx(7, 8));
+
+		ASSERT(MockTestFx(1, 2, 3) == 10);
+		MockTestGx(3, 4);
+		ASSERT(MockTestFx(4, 5, 6) == 11);
+		MockTestGx(7, 8);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+	ASSERT(test_case.Run());
+	ASSERT(MockTestBringUpScript().size() == 3);
+}
+
+TEST_CASE(MOCK_Script_MissingCall)
+{
+	auto test = [] {
+		mock_expect_script(MockTestBringUpScript());
+
+		ASSERT(MockTestFx(1, 2, 3) == 10);
+		MockTestGx(3, 4);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+TEST_CASE(MOCK_Script_MissingReturn)
+{
+	auto test = [] {
+		mock_record_script([] {
+			EXPECT(MockTestFx(1, 2, 3));
+		});
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+static uint32_t MockTestTimeMs()
+{
+	return (uint32_t)mock_clock_ms();
+}
+
+static bool MockTestWaitReady(uint32_t timeout_ms)
+{
+	uint32_t start = MockTestTimeMs();
+	while (MockTestTimeMs() - start < timeout_ms)
+		if (MockTestFx(0, 0, 0) != 0)
+			return true;
+	return false;
+}
+
+TEST_CASE(MOCK_Delay_Timeout)
+{
+	auto test = [] {
+		EXPECT(MockTestFx(0, 0, 0))_AND_DELAY(10000)_AND_RETURN(0);
+		EXPECT(MockTestFx(0, 0, 0))_AND_DELAY(10000)_AND_RETURN(0);
+		EXPECT(MockTestFx(0, 0, 0))_AND_DELAY(10000)_AND_RETURN(0);
+
+		ASSERT(!MockTestWaitReady(30000));
+		ASSERT(mock_clock_ms() == 30000);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Delay_Ready)
+{
+	auto test = [] {
+		EXPECT(MockTestFx(0, 0, 0))_AND_DELAY(20000)_AND_RETURN(0);
+		EXPECT(MockTestFx(0, 0, 0))_AND_DELAY(5000)_AND_RETURN(1);
+
+		mock_advance_clock(100);
+		ASSERT(MockTestWaitReady(30000));
+		ASSERT(mock_clock_ms() == 25100);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Delay_Double)
+{
+	auto test = [] {
+		EXPECT(MockTestGx(1, 2))_AND_DELAY(5)_AND_DELAY(5);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+typedef void (*MockTestReadCallback)(void* context, int result);
+
+static void MockTestReadAsync(int channel, MockTestReadCallback callback, void* context)
+{
+	MOCK_CALL(channel);
+	MOCK_RETURN_PENDING(int, [=](int result) { callback(context, result); });
+}
+
+static void MockTestStoreResult(void* context, int result)
+{
+	*(int*)context = result;
+}
+
+TEST_CASE(MOCK_Pending_HappyCase)
+{
+	auto test = [] {
+		MockPending<int> read;
+		EXPECT(MockTestReadAsync(3, nullptr, nullptr))_AND_RETURN_PENDING(read);
+
+		int result = -1;
+		MockTestReadAsync(3, MockTestStoreResult, &result);
+		ASSERT(read.is_attached());
+		ASSERT(mock_run_pending() == 0);
+		ASSERT(result == -1);
+
+		read.complete(42);
+		ASSERT(result == -1);
+		ASSERT(mock_run_pending() == 1);
+		ASSERT(result == 42);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Pending_ManyOutstanding)
+{
+	auto test = [] {
+		const size_t count = 1000;
+		std::vector<MockPending<int>> reads(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			EXPECT(MockTestReadAsync((int)i, nullptr, nullptr))_AND_RETURN_PENDING(reads[i]);
+		}
+
+		std::vector<int> results(count, -1);
+		for (size_t i = 0; i < count; i++)
+			MockTestReadAsync((int)i, MockTestStoreResult, &results[i]);
+		for (size_t i = count; i > 0; i--)
+			reads[i - 1].complete((int)(i - 1) * 2);
+		ASSERT(mock_run_pending() == count);
+
+		for (size_t i = 0; i < count; i++)
+			ASSERT(results[i] == (int)i * 2);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Pending_Undelivered)
+{
+	auto test = [] {
+		MockPending<int> read;
+		EXPECT(MockTestReadAsync(3, nullptr, nullptr))_AND_RETURN_PENDING(read);
+
+		int result = -1;
+		MockTestReadAsync(3, MockTestStoreResult, &result);
+		read.complete(42);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+TEST_CASE(MOCK_Pending_NeverCompleted)
+{
+	auto test = [] {
+		MockPending<int> read;
+		EXPECT(MockTestReadAsync(3, nullptr, nullptr))_AND_RETURN_PENDING(read);
+
+		int result = -1;
+		MockTestReadAsync(3, MockTestStoreResult, &result);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+TEST_CASE(MOCK_Pending_PlainReturn)
+{
+	auto test = [] {
+		EXPECT(MockTestReadAsync(3, nullptr, nullptr))_AND_RETURN(42);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+TEST_CASE(MockLatency_Sample)
+{
+	MockLatency none;
+	MockLatency fixed = MockLatency::fixed(2000);
+	MockLatency uniform = MockLatency::uniform(100, 200);
+	MockLatency histogram = MockLatency::histogram({ { 10, 1 }, { 20, 0 }, { 30, 3 } });
+
+	ASSERT(none.is_none());
+	ASSERT(none.sample(12345) == 0);
+	ASSERT(fixed.sample(12345) == 2000);
+	for (uint64_t random = 0; random < 1000; random++)
+	{
+		uint64_t ns = uniform.sample(random * 7919);
+		ASSERT(ns >= 100 && ns <= 200);
+	}
+	ASSERT(histogram.sample(0) == 10);
+	ASSERT(histogram.sample(1) == 30);
+	ASSERT(histogram.sample(3) == 30);
+	ASSERT(histogram.sample(4) == 10);
+
+	MockLatency full = MockLatency::uniform(0, UINT64_MAX);
+	ASSERT(full.sample(0) == 0);
+	ASSERT(full.sample(12345) == 12345);
+	ASSERT(full.sample(UINT64_MAX) == UINT64_MAX);
+}
+
+TEST_CASE(MOCK_Latency_BusyWait)
+{
+	auto test = [] {
+		EXPECT(MockTestGx(1, 2))_AND_LATENCY(MockLatency::fixed(2000000));
+		EXPECT(MockTestGx(3, 4));
+
+		mock_set_default_latency(MockLatency::fixed(1000000));
+		auto start = std::chrono::steady_clock::now();
+		MockTestGx(1, 2);
+		MockTestGx(3, 4);
+		auto elapsed = std::chrono::steady_clock::now() - start;
+
+		ASSERT(elapsed >= std::chrono::microseconds(3000));
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_CollectAll_HappyCase)
+{
+	auto test = [] {
+		mock_set_collect_all(true);
+		EXPECT(MockTestFx(1, 2, 3))_AND_RETURN(10);
+		EXPECT(MockTestGx(3, 4));
+
+		ASSERT(MockTestFx(1, 2, 3) == 10);
+		MockTestGx(3, 4);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_CollectAll_Resync)
+{
+	static bool reached_end = false;
+	auto test = [] {
+		reached_end = false;
+		mock_set_collect_all(true);
+		EXPECT(MockTestFx(1, 2, 3))_AND_RETURN(10);
+		EXPECT(MockTestGx(3, 4));
+		EXPECT(MockTestGx(5, 6));
+		EXPECT(MockTestFx(7, 8, 9))_AND_RETURN(11);
+		EXPECT(MockTestGx(1, 1));
+
+		ASSERT(MockTestFx(1, 5, 3) == 10);
+		ASSERT(MockTestFx(4, 4, 4) == 0);
+		MockTestGx(5, 6);
+		ASSERT(MockTestFx(7, 8, 9) == 11);
+		reached_end = true;
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+	ASSERT(reached_end);
+}
+
+TEST_CASE(MOCK_CollectAll_Reset)
+{
+	static bool reached_end = false;
+	auto collect_all = [] {
+		mock_set_collect_all(true);
+		EXPECT(MockTestGx(3, 4));
+		ASSERT(false);
+	};
+	auto mismatch = [] {
+		reached_end = false;
+		EXPECT(MockTestGx(3, 4));
+		MockTestGx(5, 6);
+		reached_end = true;
+	};
+	TestCaseListItem collect_all_case(collect_all, "MOCK_CollectAll_Reset_CollectAll", __FILE__, __LINE__);
+	TestCaseListItem mismatch_case(mismatch, "MOCK_CollectAll_Reset_Mismatch", __FILE__, __LINE__);
+
+	ASSERT(!collect_all_case.Run());
+	ASSERT(!mismatch_case.Run());
+	ASSERT(!reached_end);
+}
+
+TEST_CASE(MOCK_Sequence_Interleaved)
+{
+	auto test = [] {
+		EXPECT_IN("dma0", MockTestGx(0, 1));
+		EXPECT_IN("dma0", MockTestGx(0, 2));
+		EXPECT_IN("dma1", MockTestGx(1, 1));
+		EXPECT_IN("dma1", MockTestFx(1, 2, 3))_AND_RETURN(7);
+		EXPECT(MockTestGx(9, 9));
+
+		MockTestGx(1, 1);
+		MockTestGx(0, 1);
+		MockTestGx(9, 9);
+		ASSERT(MockTestFx(1, 2, 3) == 7);
+		MockTestGx(0, 2);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Sequence_OutOfOrder)
+{
+	auto test = [] {
+		EXPECT_IN("dma0", MockTestGx(0, 1));
+		EXPECT_IN("dma0", MockTestGx(0, 2));
+		EXPECT_IN("dma1", MockTestGx(1, 1));
+
+		MockTestGx(1, 1);
+		MockTestGx(0, 2);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+TEST_CASE(MOCK_Sequence_Missing)
+{
+	auto test = [] {
+		EXPECT_IN("dma0", MockTestGx(0, 1));
+		EXPECT_IN("dma1", MockTestGx(1, 1));
+
+		MockTestGx(1, 1);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+static int g_mock_test_interrupts = 0;
+
+static void MockTestInterrupt()
+{
+	ASSERT(mock_in_interrupt());
+	g_mock_test_interrupts++;
+}
+
+TEST_CASE(MOCK_Deferred_AfterCalls)
+{
+	auto test = [] {
+		EXPECT(MockTestFx(1, 2, 3))_AND_DO_AFTER_CALLS(2, MockTestGx(9, 9))_AND_RETURN(1);
+		EXPECT(MockTestGx(1, 1));
+		EXPECT(MockTestGx(2, 2));
+		EXPECT(MockTestGx(9, 9));
+		EXPECT(MockTestGx(3, 3));
+
+		MockTestFx(1, 2, 3);
+		MockTestGx(1, 1);
+		MockTestGx(2, 2);
+		MockTestGx(3, 3);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Deferred_AfterTime)
+{
+	auto test = [] {
+		g_mock_test_interrupts = 0;
+		EXPECT(MockTestGx(1, 1))_AND_DO_AFTER_MS(100, MockTestInterrupt())_AND_DO_AFTER_MS(100, MockTestInterrupt());
+		EXPECT(MockTestGx(2, 2))_AND_DELAY(60);
+
+		MockTestGx(1, 1);
+		mock_advance_clock(50);
+		ASSERT(g_mock_test_interrupts == 0);
+		ASSERT(!mock_in_interrupt());
+		MockTestGx(2, 2);
+		ASSERT(g_mock_test_interrupts == 2);
+
+		EXPECT(MockTestGx(3, 3))_AND_DO_AFTER_MS(10, MockTestInterrupt());
+		MockTestGx(3, 3);
+		EXPECT(MockTestGx(4, 4));
+		mock_advance_clock(10);
+		ASSERT(g_mock_test_interrupts == 3);
+		MockTestGx(4, 4);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Deferred_Throw)
+{
+	auto test = [] {
+		g_mock_test_interrupts = 0;
+		EXPECT(MockTestGx(1, 1))_AND_DO_AFTER_CALLS(0, MockTestInterrupt())_AND_THROW(std::runtime_error("test"));
+
+		ASSERT_THROWS(MockTestGx(1, 1));
+		ASSERT(g_mock_test_interrupts == 1);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+static void MockTestThrowingInterrupt()
+{
+	throw std::runtime_error("test");
+}
+
+TEST_CASE(MOCK_Deferred_ThrowInBatch)
+{
+	auto test = [] {
+		g_mock_test_interrupts = 0;
+		EXPECT(MockTestGx(1, 1))_AND_DO_AFTER_MS(10, MockTestThrowingInterrupt())_AND_DO_AFTER_MS(10, MockTestInterrupt());
+
+		MockTestGx(1, 1);
+		ASSERT_THROWS(mock_advance_clock(10));
+		ASSERT(g_mock_test_interrupts == 0);
+		ASSERT(!mock_in_interrupt());
+		mock_advance_clock(0);
+		ASSERT(g_mock_test_interrupts == 1);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Deferred_NeverRan)
+{
+	auto test = [] {
+		EXPECT(MockTestGx(1, 1))_AND_DO_AFTER_CALLS(1, MockTestGx(9, 9));
+
+		MockTestGx(1, 1);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+TEST_CASE(MOCK_SetErrno)
+{
+	auto test = [] {
+		EXPECT(MockTestFx(1, 2, 3))_AND_SET_ERRNO(EIO)_AND_RETURN(-1);
+
+		errno = 0;
+		ASSERT(MockTestFx(1, 2, 3) == -1);
+		ASSERT(errno == EIO);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+static std::string g_mock_test_failure;
+
+static void MockTestFailureHandler(const char* message)
+{
+	g_mock_test_failure = message;
+}
+
+TEST_CASE(MOCK_FailureHandler)
+{
+	static bool returned = false;
+	auto test = [] {
+		g_mock_test_failure.clear();
+		returned = false;
+		mock_set_failure_handler(MockTestFailureHandler);
+		MockTestGx(1, 2);
+		returned = true;
+		mock_set_failure_handler(nullptr);
+		ASSERT(mock_failed());
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	test_case.Run();
+	ASSERT(returned);
+	ASSERT(g_mock_test_failure == "Mock unexpected call void MockTestGx(int, int)(1, 2).");
+}
+
+static bool g_mock_test_output_long = false;
+
+static void MockTestOutputVaries(int* value, long* wide_value)
+{
+	MOCK_CALL();
+	if (g_mock_test_output_long)
+		MOCK_OUTPUT(*wide_value);
+	else
+		MOCK_OUTPUT(*value);
+}
+
+TEST_CASE(MOCK_FailureHandler_OutputType)
+{
+	static std::string failure;
+	static bool returned = false;
+	auto test = [] {
+		returned = false;
+		mock_set_failure_handler(MockTestFailureHandler);
+		int value = 5;
+		long wide_value = 6;
+		g_mock_test_output_long = false;
+		EXPECT(MockTestOutputVaries(&value, &wide_value));
+		g_mock_test_output_long = true;
+		MockTestOutputVaries(&value, &wide_value);
+		g_mock_test_output_long = false;
+		failure = g_mock_test_failure;
+		returned = (wide_value == 6);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	test_case.Run();
+	ASSERT(returned);
+	ASSERT(failure.find("Mock output of expected call 'MockTestOutputVaries(&value, &wide_value)' is ") == 0);
+}
+
+static int g_mock_test_failures = 0;
+
+static void MockTestCountFailures(const char* message)
+{
+	g_mock_test_failures++;
+}
+
+TEST_CASE(MOCK_FailureHandler_Return)
+{
+	static bool returned = false;
+	auto test = [] {
+		returned = false;
+		mock_set_failure_handler(MockTestCountFailures);
+		EXPECT(MockTestFx(1, 2, 3))_AND_RETURN(10);
+
+		ASSERT(MockTestFx(1, 5, 3) == 0);
+		ASSERT(MockTestFx(1, 2, 3) == 10);
+		returned = true;
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	g_mock_test_failures = 0;
+	test_case.Run();
+	ASSERT(returned);
+	ASSERT(g_mock_test_failures == 1);
+}
+
+TEST_CASE(MOCK_Vector_Mismatch)
+{
+	static std::vector<int> result;
+	auto test = [] {
+		g_mock_test_failures = 0;
+		mock_set_failure_handler(MockTestCountFailures);
+		EXPECT(MockTestWx(std::vector<int>({ 1, 2, 3 })))_AND_RETURN(std::vector<int>({ 4 }));
+		result = MockTestWx(std::vector<int>({ 1, 2 }));
+		ASSERT(MockTestWx(std::vector<int>({ 1, 2, 3 })) == std::vector<int>({ 4 }));
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	result = std::vector<int>({ 5 });
+	test_case.Run();
+	ASSERT(g_mock_test_failures == 1);
+	ASSERT(result.empty());
+}
+
+TEST_CASE(MOCK_FailureHandler_Reset)
+{
+	auto set_handler = [] {
+		mock_set_failure_handler(MockTestCountFailures);
+	};
+	auto unexpected = [] {
+		MockTestGx(1, 2);
+		FAIL("Mock failure was not raised.");
+	};
+	TestCaseListItem set_handler_case(set_handler, "MOCK_FailureHandler_Reset_Set", __FILE__, __LINE__);
+	TestCaseListItem unexpected_case(unexpected, "MOCK_FailureHandler_Reset_Unexpected", __FILE__, __LINE__);
+
+	g_mock_test_failures = 0;
+	ASSERT(set_handler_case.Run());
+	ASSERT(!unexpected_case.Run());
+	ASSERT(g_mock_test_failures == 0);
+}
+
+// Defined in mock_wrap_real.cpp.  The test binary is linked with
+// --wrap=MockTestWrapped and --wrap=MockTestWrappedVoid, so these calls reach the shims.
+extern "C" int MockTestWrapped(int x);
+extern "C" void MockTestWrappedVoid(int x);
+
+MOCK_WRAP(int, MockTestWrapped, (int x), (x))
+MOCK_WRAP_VOID(MockTestWrappedVoid, (int x), (x))
+
+TEST_CASE(MOCK_Wrap_Modes)
+{
+	auto test = [] {
+		ASSERT(MockTestWrapped(3) == 6);
+
+		mock_set_wrap_mode("MockTestWrapped", MOCK_WRAP_MOCK);
+		mock_set_wrap_mode("MockTestWrappedVoid", MOCK_WRAP_MOCK);
+		EXPECT(MockTestWrapped(3))_AND_RETURN(100);
+		EXPECT(MockTestWrappedVoid(4));
+		ASSERT(MockTestWrapped(3) == 100);
+		MockTestWrappedVoid(4);
+
+		mock_set_wrap_mode("MockTestWrapped", MOCK_WRAP_SPY);
+		ASSERT(MockTestWrapped(5) == 10);
+		ASSERT(MockTestWrapped(6) == 12);
+		ASSERT(mock_spy_log().size() == 2);
+		ASSERT(mock_spy_log()[1] == "MockTestWrapped(6)");
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Wrap_Unexpected)
+{
+	auto test = [] {
+		mock_set_wrap_mode("MockTestWrapped", MOCK_WRAP_MOCK);
+		MockTestWrapped(3);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+	ASSERT(MockTestWrapped(3) == 6);
+}
+
+TEST_CASE(MOCK_Wrap_ExpectNotMocked)
+{
+	static int played = 0;
+	auto test = [] {
+		g_mock_test_failure.clear();
+		mock_set_failure_handler(MockTestFailureHandler);
+		EXPECT(MockTestWrapped(3))_AND_RETURN(100);
+		mock_set_failure_handler(nullptr);
+
+		mock_set_wrap_mode("MockTestWrapped", MOCK_WRAP_MOCK);
+		played = MockTestWrapped(3);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	test_case.Run();
+	ASSERT(g_mock_test_failure == "Mock EXPECT of MockTestWrapped, which is wrapped in MOCK_WRAP_REAL mode; set MOCK_WRAP_MOCK before the EXPECT.");
+	ASSERT(played == 100);
+}
+
+#if MOCK_SHARED_EXPECTATIONS
+static int MockTestRunChild(std::function<void()> child)
+{
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		try
+		{
+			child();
+		}
+		catch (...)
+		{
+			_exit(1);
+		}
+		_exit(mock_failed() ? 1 : 0);
+	}
+	int status = -1;
+	waitpid(pid, &status, 0);
+	return status;
+}
+
+TEST_CASE(MOCK_Shared_HappyCase)
+{
+	auto test = [] {
+		EXPECT_IN("worker", MockTestGx(1, 1));
+		EXPECT_IN("worker", MockTestFx(1, 2, 3))_AND_RETURN(5);
+		EXPECT(MockTestGx(2, 2));
+		mock_share_expectations();
+
+		int status = MockTestRunChild([] {
+			MockTestGx(1, 1);
+			if (MockTestFx(1, 2, 3) != 5)
+				_exit(2);
+		});
+		ASSERT(status == 0);
+		MockTestGx(2, 2);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Shared_ChildFailure)
+{
+	auto test = [] {
+		EXPECT(MockTestGx(1, 1));
+		EXPECT(MockTestGx(2, 2));
+		mock_share_expectations();
+
+		MockTestRunChild([] {
+			MockTestGx(1, 1);
+			MockTestGx(3, 3);
+		});
+		MockTestGx(2, 2);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+TEST_CASE(MOCK_Shared_ChildAssert)
+{
+	static int status = 0;
+	auto test = [] {
+		EXPECT(MockTestGx(1, 1));
+		mock_share_expectations();
+
+		status = MockTestRunChild([] {
+			MockTestGx(1, 1);
+			ASSERT(false);
+		});
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+	ASSERT(status != 0);
+}
+
+TEST_CASE(MOCK_Shared_MissingInChild)
+{
+	auto test = [] {
+		EXPECT(MockTestGx(1, 1));
+		EXPECT(MockTestGx(2, 2));
+		mock_share_expectations();
+
+		MockTestRunChild([] {
+			MockTestGx(1, 1);
+		});
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+TEST_CASE(MOCK_Shared_ManyWorkers)
+{
+	auto test = [] {
+		const size_t workers = 4;
+		const size_t calls = 200;
+		for (size_t i = 0; i < workers * calls; i++)
+		{
+			EXPECT(MockTestGx(1, 1));
+		}
+		mock_share_expectations();
+
+		std::vector<pid_t> pids;
+		for (size_t i = 0; i < workers; i++)
+		{
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				try
+				{
+					for (size_t j = 0; j < calls; j++)
+						MockTestGx(1, 1);
+				}
+				catch (...)
+				{
+					_exit(1);
+				}
+				_exit(0);
+			}
+			pids.push_back(pid);
+		}
+		for (pid_t pid : pids)
+		{
+			int status = -1;
+			waitpid(pid, &status, 0);
+			ASSERT(status == 0);
+		}
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+#endif
+
+TEST_CASE(MOCK_Fault_Rate)
+{
+	auto test = [] {
+		mock_set_fault_policy("MockTestFx", MockFaultPolicy().set_rate(0.25).set_return(0).set_fault_return(-5));
+
+		size_t faults = 0;
+		for (size_t i = 0; i < 10000; i++)
+		{
+			if (MockTestFx(1, 2, 3) == -5)
+				faults++;
+		}
+		ASSERT(faults > 2300 && faults < 2700);
+		ASSERT(mock_fault_log().size() == faults);
+		ASSERT(mock_fault_log()[0].function == "MockTestFx");
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Fault_Reproducible)
+{
+	std::vector<uint64_t> first;
+	auto test = [&first] {
+		mock_set_random_seed(1234);
+		mock_set_fault_policy("MockTestGx", MockFaultPolicy().set_rate(0.1).set_fault_exception(std::runtime_error("fault")));
+
+		std::vector<uint64_t> faulted;
+		for (uint64_t i = 0; i < 1000; i++)
+		{
+			try
+			{
+				MockTestGx(1, 2);
+			}
+			catch (const std::runtime_error&)
+			{
+				faulted.push_back(i);
+			}
+		}
+		ASSERT(faulted.size() == mock_fault_log().size());
+		for (size_t i = 0; i < faulted.size(); i++)
+			ASSERT(mock_fault_log()[i].call == faulted[i]);
+		if (first.empty())
+			first = faulted;
+		else
+			ASSERT(first == faulted);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+	ASSERT(test_case.Run());
+	ASSERT(!first.empty());
+}
+
+TEST_CASE(MOCK_Fault_ScheduleBurst)
+{
+	auto test = [] {
+		mock_set_fault_policy("MockTestFx", MockFaultPolicy().set_schedule({ 6, 1 }).set_burst(2).set_return(1).set_fault_return(0));
+		EXPECT(MockTestGx(1, 2));
+
+		std::vector<int> results;
+		for (size_t i = 0; i < 10; i++)
+			results.push_back(MockTestFx(1, 2, 3));
+		MockTestGx(1, 2);
+
+		ASSERT(results == std::vector<int>({ 1, 0, 0, 1, 1, 1, 0, 0, 1, 1 }));
+		ASSERT(mock_fault_log().size() == 4);
+		ASSERT(mock_fault_log()[3].call == 7);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Fault_CorruptOutput)
+{
+	auto test = [] {
+		mock_set_fault_policy("MockTestIx", MockFaultPolicy().set_schedule({ 1 }).set_corrupt_output(true));
+		mock_set_fault_policy("MockTestJx", MockFaultPolicy().set_schedule({ 0 }).set_corrupt_output(true));
+
+		int value = 12345;
+		MockTestIx(&value);
+		ASSERT(value == 12345);
+		MockTestIx(&value);
+		ASSERT(value != 12345);
+
+		char data[4] = { 'a', 'b', 'c', 'd' };
+		MockTestJx(data, sizeof(data));
+		ASSERT(std::string(data, sizeof(data)) != "abcd");
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+namespace mock_test
+{
+	struct Sensor
+	{
+		static int read(int channel)
+		{
+			MOCK_CALL(channel);
+			MOCK_RETURN(int);
+		}
+	};
+
+	struct Radio
+	{
+		static int read(int channel)
+		{
+			MOCK_CALL(channel);
+			MOCK_RETURN(int);
+		}
+	};
+
+	template <typename T>
+	struct Port
+	{
+		static T read()
+		{
+			MOCK_CALL();
+			MOCK_RETURN(T);
+		}
+	};
+}
+
+TEST_CASE(MOCK_Fault_QualifiedName)
+{
+	auto test = [] {
+		mock_set_fault_policy("mock_test::Sensor::read", MockFaultPolicy().set_rate(1).set_fault_return(-1));
+		mock_set_fault_policy("mock_test::Radio::read", MockFaultPolicy().set_return(7));
+		mock_set_fault_policy("mock_test::Port<T>::read", MockFaultPolicy().set_return(3));
+
+		ASSERT(mock_test::Sensor::read(1) == -1);
+		ASSERT(mock_test::Radio::read(1) == 7);
+		ASSERT(mock_test::Port<int>::read() == 3);
+		ASSERT(mock_fault_log().size() == 1);
+		ASSERT(mock_fault_log()[0].function == "mock_test::Sensor::read");
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+static void MockTestStringOut(std::string* out)
+{
+	MOCK_CALL();
+	MOCK_OUTPUT(*out);
+}
+
+static void MockTestVectorOut(std::vector<int>* out)
+{
+	MOCK_CALL();
+	MOCK_OUTPUT(*out);
+}
+
+struct MockTestRecord
+{
+	std::string name;
+
+	bool operator==(const MockTestRecord& second) const { return name == second.name; }
+};
+
+static void MockTestRecordOut(MockTestRecord* out)
+{
+	MOCK_CALL();
+	MOCK_OUTPUT(*out);
+}
+
+TEST_CASE(MOCK_Fault_CorruptContainers)
+{
+	auto test = [] {
+		mock_set_fault_policy("MockTestStringOut", MockFaultPolicy().set_rate(1).set_corrupt_output(true));
+		mock_set_fault_policy("MockTestVectorOut", MockFaultPolicy().set_rate(1).set_corrupt_output(true));
+
+		std::string text = "abcd";
+		MockTestStringOut(&text);
+		ASSERT(text.size() == 4 && text != "abcd");
+
+		std::vector<int> values({ 1, 2, 3 });
+		MockTestVectorOut(&values);
+		ASSERT(values.size() == 3 && values != std::vector<int>({ 1, 2, 3 }));
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Fault_CorruptUnsupported)
+{
+	auto test = [] {
+		mock_set_fault_policy("MockTestRecordOut", MockFaultPolicy().set_rate(1).set_corrupt_output(true));
+
+		MockTestRecord record = { "abcd" };
+		MockTestRecordOut(&record);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(!test_case.Run());
+}
+
+TEST_CASE(MOCK_Fault_Wrapped)
+{
+	auto test = [] {
+		mock_set_wrap_mode("MockTestWrapped", MOCK_WRAP_MOCK);
+		mock_set_fault_policy("MockTestWrapped", MockFaultPolicy().set_rate(1).set_fault_return(-1));
+
+		ASSERT(MockTestWrapped(3) == -1);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+static int MockTestParseCommand()
+{
+	char command[4] = {};
+	MockTestJx(command, sizeof(command));
+	if (command[0] != 'S')
+		return -1;
+	int count = MockTestFx(0, 0, 0);
+	int total = 0;
+	for (int i = 0; i < count && i < 16; i++)
+	{
+		int value = 0;
+		MockTestIx(&value);
+		total += value;
+	}
+	return total;
+}
+
+TEST_CASE(MOCK_Fuzz_InputValues)
+{
+	auto test = [] {
+		const uint8_t input[] = { 'S', 'E', 'T', '!', 2, 0, 0, 0, 5, 0, 0, 0, 7 };
+		int total = -1;
+		mock_fuzz_one(input, sizeof(input), [&total] { total = MockTestParseCommand(); });
+		ASSERT(total == 12);
+
+		mock_fuzz_one(input, 6, [&total] { total = MockTestParseCommand(); });
+		ASSERT(total == 0);
+
+		mock_fuzz_one(nullptr, 0, [&total] { total = MockTestParseCommand(); });
+		ASSERT(total == -1);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Fuzz_ShortBuffer)
+{
+	auto test = [] {
+		const uint8_t input[] = { 'S', 'E' };
+		char buffer[4] = { 'x', 'x', 'x', 'x' };
+		mock_fuzz_one(input, sizeof(input), [&buffer] { MockTestJx(buffer, sizeof(buffer)); });
+		ASSERT(buffer[0] == 'S' && buffer[1] == 'E' && buffer[2] == 0 && buffer[3] == 0);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Fuzz_ManyRuns)
+{
+	auto test = [] {
+		uint8_t input[32] = { 'S', 'x', 'y', 'z', 16 };
+		for (size_t i = 0; i < 100000; i++)
+		{
+			input[8] = (uint8_t)i;
+			mock_fuzz_one(input, sizeof(input), [] { MockTestParseCommand(); });
+		}
+
+		EXPECT(MockTestGx(1, 2));
+		MockTestGx(1, 2);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+TEST_CASE(MOCK_Fuzz_Throws)
+{
+	auto test = [] {
+		const uint8_t input[] = { 'S', 0, 0, 0 };
+		ASSERT_THROWS(mock_fuzz_one(input, sizeof(input), [] {
+			MockTestParseCommand();
+			throw std::runtime_error("parse error");
+		}));
+
+		EXPECT(MockTestFx(1, 2, 3))_AND_RETURN(4);
+		ASSERT(MockTestFx(1, 2, 3) == 4);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+}
+
+#ifndef MOCK_TEST_BUILD_DIR
+#define MOCK_TEST_BUILD_DIR "."
+#endif
+
+static std::string MockTestReadFile(const char* path)
+{
+	std::ifstream file(path);
+	std::stringstream contents;
+	contents << file.rdbuf();
+	return contents.str();
+}
+
+static size_t MockTestCount(const std::string& text, const std::string& pattern)
+{
+	size_t count = 0;
+	for (size_t i = text.find(pattern); i != std::string::npos; i = text.find(pattern, i + 1))
+		count++;
+	return count;
+}
+
+TEST_CASE(MOCK_Trace_HappyCase)
+{
+	static const char* path = MOCK_TEST_BUILD_DIR "/mock_trace_happy_case.json";
+	auto test = [] {
+		mock_set_trace(path);
+		EXPECT(MockTestFx(1, 2, 3))_AND_DO(g_mock_test_interrupts++)_AND_RETURN(10);
+		int out = 5;
+		EXPECT(MockTestIx(&out))_AND_DO_AFTER_CALLS(0, MockTestInterrupt());
+
+		MockTestFx(1, 2, 3);
+		int value = 0;
+		MockTestIx(&value);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+
+	std::string trace = MockTestReadFile(path);
+	std::remove(path);
+	ASSERT(trace.find("\"traceEvents\":[") != std::string::npos);
+	ASSERT(MockTestCount(trace, "\"name\":\"MockTestFx\"") == 3);
+	ASSERT(MockTestCount(trace, "\"name\":\"MockTestIx\"") == 3);
+	ASSERT(MockTestCount(trace, "\"ph\":\"X\"") == 2);
+	ASSERT(MockTestCount(trace, "\"cat\":\"output\"") == 1);
+	ASSERT(trace.find("\"tid\":") != std::string::npos);
+}
+
+TEST_CASE(MOCK_Trace_RingWraps)
+{
+	static const char* path = MOCK_TEST_BUILD_DIR "/mock_trace_ring_wraps.json";
+	auto test = [] {
+		mock_set_trace(path, 4);
+		for (int i = 0; i < 10; i++)
+		{
+			EXPECT(MockTestGx(i, i));
+		}
+		for (int i = 0; i < 10; i++)
+			MockTestGx(i, i);
+	};
+	TestCaseListItem test_case(test, __FUNCTION__, __FILE__, __LINE__);
+
+	ASSERT(test_case.Run());
+
+	std::string trace = MockTestReadFile(path);
+	std::remove(path);
+	ASSERT(MockTestCount(trace, "\"name\":\"MockTestGx\"") == 4);
+}
+
+TEST_CASE(MOCK_Trace_Reset)
+{
+	static const char* path = MOCK_TEST_BUILD_DIR "/mock_trace_reset.json";
+	auto traced = [] {
+		mock_set_trace(path);
+		EXPECT(MockTestGx(1, 2));
+		MockTestGx(1, 2);
+	};
+	auto untraced = [] {
+		EXPECT(MockTestGx(3, 4));
+		MockTestGx(3, 4);
+	};
+	TestCaseListItem traced_case(traced, "MOCK_Trace_Reset_Traced", __FILE__, __LINE__);
+	TestCaseListItem untraced_case(untraced, "MOCK_Trace_Reset_Untraced", __FILE__, __LINE__);
+
+	ASSERT(traced_case.Run());
+	std::remove(path);
+	ASSERT(untraced_case.Run());
+	ASSERT(!std::ifstream(path).good());
+}
@@ -0,0 +1,12 @@
+// Real implementations for the MOCK_WRAP tests.  They live apart from the tests
+// because the linker only redirects calls made from other object files, and the
+// test binary is linked with --wrap for each of them.
+
+extern "C" int MockTestWrapped(int x)
+{
+	return x * 2;
+}
+
+extern "C" void MockTestWrappedVoid(int x)
+{
+}